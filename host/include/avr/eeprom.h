@@ -0,0 +1,19 @@
+#ifndef AVR_EEPROM_H
+#define AVR_EEPROM_H
+
+// EEPROM access backed by host_eeprom[] (see uzebox.h)
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define eeprom_is_ready() 1
+#define eeprom_busy_wait()
+uint8_t eeprom_read_byte(const uint8_t* addr);
+uint16_t eeprom_read_word(const uint16_t* addr);
+void eeprom_read_block(void* dst, const void* src, size_t n);
+void eeprom_write_byte(uint8_t* addr, uint8_t value);
+void eeprom_write_word(uint16_t* addr, uint16_t value);
+void eeprom_update_byte(uint8_t* addr, uint8_t value);
+void eeprom_update_block(const void* src, void* dst, size_t n);
+
+#endif
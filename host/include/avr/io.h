@@ -0,0 +1,21 @@
+#ifndef AVR_IO_H
+#define AVR_IO_H
+
+// Registers used by the debug builds, backed by plain variables on the host
+
+#include <stdint.h>
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIFR0;
+extern volatile uint16_t SP;
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define TOV0 0
+#define RAMEND 0x10FF
+#define E2END 0x7FF
+
+#endif
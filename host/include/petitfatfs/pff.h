@@ -0,0 +1,34 @@
+/* A host stand-in for the kernel's Petit FatFs. Instead of an SD card,
+   files are read from the directory named by the HOST_SD environment
+   variable, the same way emulators map a folder to the card. Without
+   HOST_SD there is no card. Only the calls laser2.c uses are here. */
+
+#ifndef PFF_H
+#define PFF_H
+
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+
+typedef enum {
+  FR_OK = 0,
+  FR_DISK_ERR,
+  FR_NOT_READY,
+  FR_NO_FILE,
+  FR_NOT_OPENED,
+  FR_NOT_ENABLED,
+  FR_NO_FILESYSTEM
+} FRESULT;
+
+typedef struct {
+  DWORD fptr;
+  DWORD fsize;
+} FATFS;
+
+FRESULT pf_mount(FATFS* fs);
+FRESULT pf_open(const char* path);
+FRESULT pf_read(void* buff, UINT btr, UINT* br);
+FRESULT pf_lseek(DWORD ofs);
+
+#endif
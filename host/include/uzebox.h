@@ -0,0 +1,139 @@
+/* A host stand-in for the parts of the Uzebox kernel (video mode 3)
+   that laser2.c uses, so the game can be compiled and run natively
+   without a console or an emulator. Video calls write to vram[] and
+   sprites[] exactly like the kernel does, and nothing is drawn until
+   a tool renders those buffers itself (see Host_Render in
+   uzebox.c). Sound calls do nothing. */
+
+#ifndef UZEBOX_H
+#define UZEBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t u8;
+typedef int8_t s8;
+typedef uint16_t u16;
+typedef int16_t s16;
+typedef uint32_t u32;
+
+// Kernel settings, matching default/Makefile
+#ifndef MAX_SPRITES
+#define MAX_SPRITES 13
+#endif
+#ifndef RAM_TILES_COUNT
+#define RAM_TILES_COUNT 28
+#endif
+#ifndef SCREEN_TILES_V
+#define SCREEN_TILES_V 28
+#endif
+#ifndef TRANSLUCENT_COLOR
+#define TRANSLUCENT_COLOR 0xad
+#endif
+#define SCREEN_TILES_H 30
+#define VRAM_TILES_H SCREEN_TILES_H
+#define VRAM_TILES_V SCREEN_TILES_V
+#define TILE_WIDTH 8
+#define TILE_HEIGHT 8
+#define VRAM_PTR_TYPE char
+#define OFF_SCREEN (SCREEN_TILES_V * TILE_HEIGHT)
+
+#define SPRITE_FLIP_X 0x01
+#define SPRITE_FLIP_Y 0x02
+#define SPRITE_BANK0 0x00
+#define SPRITE_BANK1 0x40
+#define SPRITE_BANK2 0x80
+#define SPRITE_BANK3 0xc0
+
+#define BTN_B      1
+#define BTN_Y      2
+#define BTN_SELECT 4
+#define BTN_START  8
+#define BTN_UP     16
+#define BTN_DOWN   32
+#define BTN_LEFT   64
+#define BTN_RIGHT  128
+#define BTN_A      256
+#define BTN_X      512
+#define BTN_SL     1024
+#define BTN_SR     2048
+
+struct SpriteStruct {
+  u8 x;
+  u8 y;
+  u8 tileIndex;
+  u8 flags;
+};
+
+struct EepromBlockStruct {
+  u16 id;
+  u8 data[30];
+};
+
+struct PatchStruct {
+  u8 type;
+  const char* pcmData;
+  const char* cmdStream;
+  u16 loopStart;
+  u16 loopEnd;
+};
+
+enum {
+  PC_ENV_SPEED, PC_NOISE_PARAMS, PC_WAVE, PC_NOTE_UP, PC_NOTE_DOWN,
+  PC_NOTE_CUT, PC_NOTE_HOLD, PC_ENV_VOL, PC_PITCH, PC_TREMOLO_LEVEL,
+  PC_TREMOLO_RATE, PC_SLIDE, PC_SLIDE_SPEED, PC_LOOP_START, PC_LOOP_END,
+  PATCH_END = 0xff
+};
+
+#define EEPROM_ERROR_BLOCK_NOT_FOUND 0x03
+
+typedef void (*VsyncCallBackFunc)(void);
+
+extern struct SpriteStruct sprites[MAX_SPRITES];
+extern u8 vram[VRAM_TILES_H * VRAM_TILES_V];
+extern u8 ram_tiles[RAM_TILES_COUNT * TILE_WIDTH * TILE_HEIGHT];
+
+// Video
+void ClearVram(void);
+void SetTile(char x, char y, unsigned int tileId);
+void SetRamTile(u8 x, u8 y, u8 ramTileNo);
+void DrawMap(u8 x, u8 y, const VRAM_PTR_TYPE* map);
+void SetTileTable(const char* data);
+void SetSpritesTileBank(u8 bank, const char* data);
+void MapSprite2(u8 startSprite, const char* map, u8 spriteFlags);
+void MoveSprite(u8 startSprite, u8 x, u8 y, u8 width, u8 height);
+void SetUserRamTilesCount(u8 count);
+u8* GetUserRamTile(u8 index);
+void WaitVsync(int count);
+void SetUserPreVsyncCallback(VsyncCallBackFunc func);
+void SetUserPostVsyncCallback(VsyncCallBackFunc func);
+
+// Input
+unsigned int ReadJoypad(unsigned char joypadNo);
+
+// Sound
+void InitMusicPlayer(const struct PatchStruct* patchPointersParam);
+void TriggerNote(unsigned char channel, unsigned char patch, unsigned char note, unsigned char volume);
+void StartSong(const char* song);
+void StopSong(void);
+void ResumeSong(void);
+bool IsSongPlaying(void);
+
+// EEPROM
+char EEPROM_ReadBlock(unsigned int blockId, struct EepromBlockStruct* block);
+char EEPROM_WriteBlock(struct EepromBlockStruct* block);
+
+// Host only
+extern unsigned int host_joypad;        // value returned by ReadJoypad
+extern uint32_t host_vsyncs;            // number of vsyncs so far
+extern u8 host_eeprom[2048];
+#define HOST_SCREEN_WIDTH (SCREEN_TILES_H * TILE_WIDTH)
+#define HOST_SCREEN_HEIGHT (SCREEN_TILES_V * TILE_HEIGHT)
+/* Renders vram[] and sprites[] the way video mode 3 would, into a
+   HOST_SCREEN_WIDTH x HOST_SCREEN_HEIGHT buffer of 8-bit BBGGGRRR
+   pixels */
+void Host_Render(u8* framebuffer);
+// Converts a BBGGGRRR pixel into 8-bit R, G and B values
+void Host_PixelToRGB(u8 pixel, u8* rgb);
+
+#endif
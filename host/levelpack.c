@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Writes a level pack (LEVELS.DAT, see "Level packs" in laser2.c) for
+  the SD card, or for the HOST_SD directory of the host build.
+
+    levelpack LEVELS.DAT                          the levels in levelData
+    levelpack LEVELS.DAT pieces.txt levels.txt    the levels in levels.txt
+
+  levels.txt is a list of words ('#' starts a comment). Each level is
+  "level", its number of targets, and then its pieces in the order of
+  levelData: the puzzle and the solution row by row, and the hand. A
+  piece is its name in pieces.txt (without the P_), or "." for BLANK.
+*/
+
+// Pull in the whole game, for its level format and levels
+#define main laser2_main
+#include "../laser2.c"
+#undef main
+
+#include "names.h"
+
+#define MAX_PACK_LEVELS PACK_MAX_LEVELS
+
+uint8_t levels[MAX_PACK_LEVELS][LEVEL_SIZE];
+size_t count;
+
+int read_levels(const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", filename);
+    return -1;
+  }
+  char line[256];
+  int lineno = 0;
+  size_t i = LEVEL_SIZE; // the byte of the current level that comes next
+  while (fgets(line, sizeof(line), fp)) {
+    ++lineno;
+    line[strcspn(line, "#\r\n")] = 0;
+    for (char* word = strtok(line, " \t"); word; word = strtok(NULL, " \t")) {
+      if (!strcmp(word, "level")) {
+        if (i != LEVEL_SIZE) {
+          fprintf(stderr, "%s:%d: the level before this one is incomplete\n", filename, lineno);
+          return -1;
+        }
+        if (count == MAX_PACK_LEVELS) {
+          fprintf(stderr, "%s:%d: too many levels\n", filename, lineno);
+          return -1;
+        }
+        ++count;
+        i = 0;
+      } else if (i == LEVEL_SIZE) {
+        fprintf(stderr, "%s:%d: expected \"level\", not \"%s\"\n", filename, lineno, word);
+        return -1;
+      } else if (i == 0) {
+        // The targets come first in the text, but last in the level
+        char* end;
+        unsigned long targets = strtoul(word, &end, 10);
+        if (*end || targets > 9) {
+          fprintf(stderr, "%s:%d: expected the number of targets, not \"%s\"\n", filename, lineno, word);
+          return -1;
+        }
+        levels[count - 1][LEVEL_SIZE - 1] = targets;
+        ++i;
+      } else {
+        size_t piece = 0;
+        if (strcmp(word, ".") != 0)
+          for (piece = 0; piece < P_COUNT; ++piece)
+            if (!strcmp(names[piece], word))
+              break;
+        if (piece == P_COUNT) {
+          fprintf(stderr, "%s:%d: no such piece: %s\n", filename, lineno, word);
+          return -1;
+        }
+        levels[count - 1][i - 1] = piece;
+        ++i;
+      }
+    }
+  }
+  fclose(fp);
+  if (i != LEVEL_SIZE) {
+    fprintf(stderr, "%s: the last level is incomplete\n", filename);
+    return -1;
+  }
+  if (!count) {
+    fprintf(stderr, "%s: no levels\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Packs the pieces into PACK_PIECE_BITS each, the opposite of LevelPack_Load
+void pack_level(const uint8_t* level, uint8_t* packed)
+{
+  memset(packed, 0, PACK_LEVEL_SIZE);
+  for (size_t i = 0; i < LEVEL_SIZE - 1; ++i)
+    for (size_t b = 0; b < PACK_PIECE_BITS; ++b)
+      if (level[i] & (1 << b)) {
+        size_t bit = i * PACK_PIECE_BITS + b;
+        packed[bit / 8] |= 1 << (bit % 8);
+      }
+  packed[PACK_LEVEL_SIZE - 1] = level[LEVEL_SIZE - 1];
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 4) {
+    fprintf(stderr, "Usage: %s LEVELS.DAT [pieces.txt levels.txt]\n", argv[0]);
+    return -1;
+  }
+
+  if (argc == 4) {
+    if (read_names(argv[2]) != 0 || read_levels(argv[3]) != 0)
+      return -1;
+  } else {
+    count = (LEVELS < MAX_PACK_LEVELS) ? LEVELS : MAX_PACK_LEVELS;
+    memcpy_P(levels, levelData, count * LEVEL_SIZE);
+  }
+
+  // The header sector, then the levels, without any straddling two sectors
+  static uint8_t sectors[1 + (MAX_PACK_LEVELS + PACK_LEVELS_PER_SECTOR - 1) / PACK_LEVELS_PER_SECTOR][PACK_SECTOR_SIZE];
+  const uint8_t header[PACK_HEADER_SIZE] = { 'L', '2', 'P', 'K', BOARD_WIDTH, BOARD_HEIGHT, HAND_SIZE, count };
+  memcpy(sectors[0], header, sizeof(header));
+  for (size_t n = 0; n < count; ++n)
+    pack_level(levels[n], &sectors[1 + n / PACK_LEVELS_PER_SECTOR][(n % PACK_LEVELS_PER_SECTOR) * PACK_LEVEL_SIZE]);
+
+  FILE* fp = fopen(argv[1], "wb");
+  size_t size = (1 + (count + PACK_LEVELS_PER_SECTOR - 1) / PACK_LEVELS_PER_SECTOR) * PACK_SECTOR_SIZE;
+  if (!fp || fwrite(sectors, 1, size, fp) != size) {
+    fprintf(stderr, "Error: Unable to write \"%s\"\n", argv[1]);
+    return -1;
+  }
+  fclose(fp);
+  fprintf(stderr, "%s: %zu levels, %zu bytes each (%d unpacked)\n", argv[1], count,
+          (size_t)PACK_LEVEL_SIZE, LEVEL_SIZE);
+  return 0;
+}
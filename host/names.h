@@ -0,0 +1,31 @@
+/*
+  The names of the pieces, read from data/pieces.txt, for the host tools
+  that read or write pieces as text. Include after laser2.c.
+*/
+
+#define MAX_NAME 32
+
+char names[P_COUNT][MAX_NAME];
+
+int read_names(const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", filename);
+    return -1;
+  }
+  char line[256];
+  size_t pieces = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    char keyword[16], name[MAX_NAME];
+    if ((sscanf(line, "%15s %31s", keyword, name) == 2) &&
+        (!strcmp(keyword, "piece") || !strcmp(keyword, "unknown")) && (pieces < P_COUNT))
+      strcpy(names[pieces++], name);
+  }
+  fclose(fp);
+  if (pieces != P_COUNT) {
+    fprintf(stderr, "Error: \"%s\" doesn't match the pieces the game was built with\n", filename);
+    return -1;
+  }
+  return 0;
+}
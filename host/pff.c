@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/petitfatfs/pff.h"
+
+static FATFS* mounted;
+static FILE* file;
+
+FRESULT pf_mount(FATFS* fs)
+{
+  if (!getenv("HOST_SD"))
+    return FR_NOT_READY;
+  mounted = fs;
+  return FR_OK;
+}
+
+FRESULT pf_open(const char* path)
+{
+  if (!mounted)
+    return FR_NOT_ENABLED;
+  if (file)
+    fclose(file);
+  char name[1024];
+  snprintf(name, sizeof(name), "%s/%s", getenv("HOST_SD"), path);
+  file = fopen(name, "rb");
+  if (!file)
+    return FR_NO_FILE;
+  fseek(file, 0, SEEK_END);
+  mounted->fsize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  mounted->fptr = 0;
+  return FR_OK;
+}
+
+FRESULT pf_read(void* buff, UINT btr, UINT* br)
+{
+  if (!file)
+    return FR_NOT_OPENED;
+  *br = fread(buff, 1, btr, file);
+  mounted->fptr += *br;
+  return ferror(file) ? FR_DISK_ERR : FR_OK;
+}
+
+// Like Petit FatFs, seeking past the end stops at the end
+FRESULT pf_lseek(DWORD ofs)
+{
+  if (!file)
+    return FR_NOT_OPENED;
+  if (ofs > mounted->fsize)
+    ofs = mounted->fsize;
+  mounted->fptr = ofs;
+  return fseek(file, ofs, SEEK_SET) ? FR_DISK_ERR : FR_OK;
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Checks the tick count of the frame-time profiler (see "Frame-time
+  profiler" in laser2.c) against busy loops of known lengths, started
+  all over the frame. Timer0 and the vsyncs are simulated the way they
+  run in video mode 3: 262 lines of 1820 cycles to a frame, and a tick
+  every 1024 cycles.
+
+    profile
+
+  Prints every loop that was timed wrong, and returns non-zero if there
+  were any.
+*/
+
+// Pull in the whole game, with the profiler
+#define main laser2_main
+#include "../laser2.c"
+#undef main
+
+#define CYCLES_PER_TICK 1024
+#define CYCLES_PER_FRAME (262UL * 1820)
+
+static uint32_t cycles;
+
+// Lets a number of cycles go by, ticking Timer0 and calling the vsync callback
+static void run(uint32_t count) {
+  uint32_t end = cycles + count;
+  for (;;) {
+    uint32_t tick = (cycles / CYCLES_PER_TICK + 1) * CYCLES_PER_TICK;
+    uint32_t vsync = (cycles / CYCLES_PER_FRAME + 1) * CYCLES_PER_FRAME;
+    if ((tick > end) && (vsync > end))
+      break;
+    if (tick <= vsync) {
+      cycles = tick;
+      if (!++TCNT0)
+        TIFR0 |= _BV(TOV0);
+    }
+    if (vsync <= tick) { // on the same cycle, the tick comes first
+      cycles = vsync;
+      Debug_Vsync();
+      TIFR0 = 0; // writing a one clears the flag on the console, but sets it here
+    }
+  }
+  cycles = end;
+}
+
+int main(void) {
+  static const uint16_t lengths[] = { 1, 100, 255, 256, 257, 300, 398, 466, 511, 512, 700, 1000, 1500 };
+  int errors = 0;
+  Debug_Init();
+  for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    for (uint32_t start = 0; start < CYCLES_PER_FRAME; start += CYCLES_PER_FRAME / 97) {
+      run(CYCLES_PER_FRAME - cycles % CYCLES_PER_FRAME + start);
+      profilePhase[PROFILE_BEAM] = 0;
+      profileLastTick = Profile_Ticks();
+      run((uint32_t)lengths[i] * CYCLES_PER_TICK);
+      Profile_Mark(PROFILE_BEAM);
+
+      /* A vsync adds PROFILE_TICKS_PER_FRAME ticks, a bit more than a
+         frame really takes, and restarts Timer0 part way into a tick */
+      uint16_t vsyncs = lengths[i] / 465 + 1;
+      if (abs((int)profilePhase[PROFILE_BEAM] - lengths[i]) > 1 + vsyncs) {
+        printf("Error: a loop of %u ticks, %lu cycles into a frame, took %u ticks\n",
+               lengths[i], (unsigned long)start, profilePhase[PROFILE_BEAM]);
+        ++errors;
+      }
+    }
+  return errors ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+  Decodes share codes (see "Share codes" in laser2.c) into the level and
+  the arrangement of the board and the hand that they stand for.
+
+    sharecode pieces.txt CODE...
+
+  Each code is printed as "level" and its number, the board row by row
+  and then the hand, with pieces named as in pieces.txt (without the
+  P_), or "." for BLANK. Codes for the levels of a level pack are read
+  with the pack in HOST_SD, like the game does.
+*/
+
+// Pull in the whole game, to restore codes exactly like it does
+#define main laser2_main
+#include "../laser2.c"
+#undef main
+
+#include "names.h"
+
+void print_piece(uint8_t piece, bool last)
+{
+  printf("%s%c", (piece == P_BLANK) ? "." : names[piece], last ? '\n' : ' ');
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s pieces.txt CODE...\n", argv[0]);
+    return -1;
+  }
+  if (read_names(argv[1]) != 0)
+    return -1;
+
+  SetUserPostVsyncCallback(&VramQueue_Vsync);
+  LevelPack_Open(); // only if HOST_SD has a LEVELS.DAT
+
+  int retval = 0;
+  for (int arg = 2; arg < argc; ++arg) {
+    const char* code = argv[arg];
+    shareLength = 0;
+    for (const char* p = code; *p; ++p) {
+      if (!isalpha((unsigned char)*p) || shareLength == SHARE_CODE_MAX) {
+        shareLength = 0;
+        break;
+      }
+      shareCode[shareLength++] = toupper((unsigned char)*p) - 'A';
+    }
+    uint8_t level = shareLength ? Share_Decode(false) : 0;
+    if (!level) {
+      fprintf(stderr, "%s: not a share code\n", code);
+      retval = -1;
+      continue;
+    }
+    LoadLevel(level, false);
+    Share_Decode(true);
+    VramQueue_Drain();
+
+    printf("# %s\nlevel %u\n", code, level);
+    for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+      for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+        print_piece(board[y][x] & 0x1F, x == BOARD_WIDTH - 1);
+    for (uint8_t x = 0; x < HAND_SIZE; ++x)
+      print_piece(hand[x], x == HAND_SIZE - 1);
+  }
+  return retval;
+}
@@ -0,0 +1,277 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <png.h>
+
+// Pull in the whole game, so its static functions and data are visible
+#define main laser2_main
+#include "../laser2.c"
+#undef main
+
+int encode_png(const char* pngfile, const uint8_t* rgb, uint32_t w, uint32_t h)
+{
+  FILE *fp = fopen(pngfile, "wb");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", pngfile);
+    return -1;
+  }
+
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                (png_voidp)NULL, NULL, NULL);
+  if (!png_ptr) {
+    fprintf(stderr, "png_create_write_struct() failed\n");
+    fclose(fp);
+    return -1;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    fprintf(stderr, "png_create_info_struct() failed\n");
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    fclose(fp);
+    return -1;
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    fprintf(stderr, "longjmp() called\n");
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(fp);
+    return -1;
+  }
+
+  png_init_io(png_ptr, fp);
+  png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (uint32_t y = 0; y < h; ++y)
+    png_write_row(png_ptr, (png_const_bytep)&rgb[y * w * 3]);
+  png_write_end(png_ptr, NULL);
+
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(fp);
+  return 0;
+}
+
+// FNV-1a, so snapshots can be compared without storing the images
+uint32_t hash(const uint8_t* data, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Renders the screen, writes it to <outdir>/<name>.png (if outdir is
+   not NULL), and prints a line for the golden file */
+int snapshot(const char* outdir, const char* name)
+{
+  static uint8_t fb[HOST_SCREEN_WIDTH * HOST_SCREEN_HEIGHT];
+  static uint8_t rgb[HOST_SCREEN_WIDTH * HOST_SCREEN_HEIGHT * 3];
+
+  Host_Render(fb);
+  for (size_t i = 0; i < sizeof(fb); ++i)
+    Host_PixelToRGB(fb[i], &rgb[i * 3]);
+
+  printf("%s 0x%08x\n", name, hash(fb, sizeof(fb)));
+
+  if (outdir) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.png", outdir, name);
+    return encode_png(path, rgb, HOST_SCREEN_WIDTH, HOST_SCREEN_HEIGHT);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char* outdir = (argc > 1) ? argv[1] : NULL;
+  int retval = 0;
+
+  // Same setup as the game uses once the title screen is done
+  SetTileTable(tileset);
+  SetSpritesTileBank(0, mysprites);
+  SetSpritesTileBank(1, tileset);
+  SetUserPostVsyncCallback(&VramQueue_Vsync);
+  LevelPack_Open(); // only if HOST_SD has a LEVELS.DAT
+  DrawGameScreen();
+  sprites[MAX_SPRITES - 1].x = OFF_SCREEN; // no cursor
+  srand(1);
+
+  // Levels are loaded one after another, like paging through them with NEXT
+  for (uint8_t level = 1; level <= levelCount; ++level) {
+    char name[32];
+
+    // The puzzle as it is handed to the player
+    LoadLevel(level, false);
+    VramQueue_Drain();
+    LevelPack_Prefetch(); // as the idle frames would
+    snprintf(name, sizeof(name), "level%02u_off", level);
+    retval |= snapshot(outdir, name);
+
+    // The solution, once the laser has swept across it
+    LoadLevel(level, true);
+    Beam_Start();
+    while (Beam_Update())
+      WaitVsync(1);
+    VramQueue_Drain();
+    snprintf(name, sizeof(name), "level%02u_on", level);
+    retval |= snapshot(outdir, name);
+    EraseLaser(); // as when Y is released, before NEXT can be clicked
+  }
+
+  /* A splitter loop: the laser goes into a splitter that either lets it
+     out of the top, or bounces it around a loop of double mirrors and
+     back into the splitter from the bottom, again and again. Every
+     photon has to stop once it enters a cell from a side it has entered
+     it from before, so none may take more than one step per cell and
+     side, and the loop must get lit. */
+  LoadLevel(1, false);
+  memset(board, P_BLANK, sizeof(board));
+  memset(hand, P_BLANK, sizeof(hand));
+  board[1][0] = P_LASER_R;
+  board[1][1] = P_SPLIT_TRBL;
+  board[1][3] = P_DBL_MIRROR_TLBR;
+  board[3][3] = P_DBL_MIRROR_TRBL;
+  board[3][1] = P_DBL_MIRROR_TLBR;
+  memset(laser, 0, sizeof(laser));
+  for (uint16_t photon = 0; photon < 20000; ++photon) {
+    uint8_t steps = 0;
+    Photon_Emit();
+    while (Photon_Step())
+      if (++steps > 4 * BOARD_CELLS) {
+        fprintf(stderr, "Error: A photon is still going around the splitter loop\n");
+        retval = -1;
+        break;
+      }
+  }
+  if (!(laser[3][3] & D_IN_T) || !(laser[1][1] & D_IN_B)) {
+    fprintf(stderr, "Error: The splitter loop didn't get lit\n");
+    retval = -1;
+  }
+  DrawLevel(1, false);
+  Beam_Start();
+  while (Beam_Update())
+    WaitVsync(1);
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "splitter_loop");
+  EraseLaser();
+
+  /* Edits through the undo journal: the first hand piece is moved to
+     the first blank cell and turned, then undone (which must look like
+     level01_off) and redone (which must look like level01_moved) */
+  LoadLevel(1, false);
+  uint8_t from = BOARD_CELLS, to = 0;
+  while ((from < BOARD_CELLS + HAND_SIZE - 1) && (*CellPiece(from) == P_BLANK))
+    ++from;
+  while ((to < BOARD_CELLS - 1) && ((*CellPiece(to) & 0x1F) != P_BLANK))
+    ++to;
+  Journal_Move(from, to, 1, true);
+  Journal_Record(from, to, 1);
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "level01_moved");
+  Journal_Undo();
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "level01_undo");
+  Journal_Redo();
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "level01_redo");
+
+  // Its share code, restored over a fresh copy of the level
+  DrawShareScreen(1);
+  retval |= snapshot(outdir, "share");
+  if (!shareLength) {
+    fprintf(stderr, "Error: The arrangement has no share code\n");
+    retval = -1;
+  }
+  RamFont_Unload();
+  DrawGameScreen();
+  LoadLevel(1, false);
+  if (Share_Decode(true) != 1) {
+    fprintf(stderr, "Error: The share code doesn't restore level 1\n");
+    retval = -1;
+  }
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "level01_shared");
+
+  // A hint on a fresh copy, blinking and then put back
+  LoadLevel(1, false);
+  Hint_Start(1);
+  Hint_Update(false);
+  VramQueue_Drain();
+  retval |= snapshot(outdir, "level01_hint");
+  Hint_Update(true);
+  VramQueue_Drain();
+  if (hintCell != HINT_NONE) {
+    fprintf(stderr, "Error: The hint is still showing\n");
+    retval = -1;
+  }
+  retval |= snapshot(outdir, "level01_unhinted");
+
+  /* A hint that is blinking when a level is loaded (as from the level
+     select screen) must not blink on the new board, which has to look
+     like level01_off */
+  Hint_Start(1);
+  Hint_Update(false);
+  VramQueue_Drain();
+  LoadLevel(1, false);
+  for (uint8_t frame = 0; frame < 2 * HINT_BLINK_FRAMES; ++frame)
+    Hint_Update(false);
+  VramQueue_Drain();
+  if (hintCell != HINT_NONE) {
+    fprintf(stderr, "Error: The hint of the old board is still showing\n");
+    retval = -1;
+  }
+  retval |= snapshot(outdir, "level01_reloaded");
+
+  /* Play statistics: level 2 is played for a minute and a half, with
+     the laser fired twice before it is solved, and level 3 for a bit.
+     A minute in, the record of level 2 (from flash) must have been
+     written, a byte per frame. The EEPROM ends up in
+     <outdir>/eeprom.bin, for host/stats. */
+  if (levelCount >= 3) { // not on other board sizes, without their pack
+    LoadLevel(2, false);
+    for (uint16_t frame = 0; frame < 5400; ++frame) {
+      if ((frame == 1000) || (frame == 5000))
+        Stats_Count(STATS_LASERS);
+      if (frame % 700 == 0)
+        Stats_Count(STATS_ROTATIONS);
+      Stats_Frame();
+      if ((frame == STATS_FLUSH_FRAMES + 60) && statsLevel &&
+          (eeprom_read_word((const uint16_t*)(uintptr_t)(statsAddress + STATS_FRAMES)) != STATS_FLUSH_FRAMES)) {
+        fprintf(stderr, "Error: The statistics weren't written after a minute\n");
+        retval = -1;
+      }
+    }
+    Stats_Solved();
+    LoadLevel(3, false);
+    for (uint16_t frame = 0; frame < 2000; ++frame)
+      Stats_Frame();
+    Stats_Count(STATS_MOVES);
+    LoadLevel(1, false);
+  }
+  if (outdir) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/eeprom.bin", outdir);
+    FILE* fp = fopen(path, "wb");
+    if (!fp || fwrite(host_eeprom, 1, sizeof(host_eeprom), fp) != sizeof(host_eeprom)) {
+      fprintf(stderr, "Error: Unable to write \"%s\"\n", path);
+      retval = -1;
+    }
+    if (fp)
+      fclose(fp);
+  }
+
+  // The level select screen, with a few levels solved
+  Progress_Load();
+  for (uint8_t level = 1; level <= levelCount; level += 7)
+    Progress_SetSolved(level);
+  DrawSelectScreen(levelCount / 2);
+  retval |= snapshot(outdir, "select");
+
+  return retval ? -1 : 0;
+}
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Prints the play statistics (see "Play statistics" in laser2.c) kept in
+  an EEPROM image, such as the eeprom.bin that cuzebox saves.
+
+    stats eeprom.bin
+
+  Each level that has a record gets a line with whether it has been
+  solved, how often the laser was fired, how many pieces were moved and
+  rotated, and how long it was played, in frames and in minutes and
+  seconds, all up to the first time it was solved.
+*/
+
+// Pull in the whole game, for the layout of the records
+#define main laser2_main
+#include "../laser2.c"
+#undef main
+
+#define FRAMES_PER_SECOND 60
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s eeprom.bin\n", argv[0]);
+    return -1;
+  }
+
+  FILE* fp = fopen(argv[1], "rb");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", argv[1]);
+    return -1;
+  }
+  size_t size = fread(host_eeprom, 1, sizeof(host_eeprom), fp);
+  fclose(fp);
+  if (size != sizeof(host_eeprom)) {
+    fprintf(stderr, "Error: \"%s\" is not a %zu byte EEPROM image\n", argv[1], sizeof(host_eeprom));
+    return -1;
+  }
+
+  printf("level solved lasers moves rotations   frames     time\n");
+  for (uint8_t level = 1; level <= STATS_MAX_LEVELS; ++level) {
+    uint16_t block = FindEepromBlock(STATS_EEPROM_ID + (level - 1) / STATS_LEVELS_PER_BLOCK);
+    if (!block)
+      continue;
+    const uint8_t* record = &host_eeprom[block + 2 + ((level - 1) % STATS_LEVELS_PER_BLOCK) * STATS_RECORD_SIZE];
+    uint32_t frames = record[STATS_FRAMES] | (record[STATS_FRAMES + 1] << 8) |
+                      ((record[STATS_FRAMES + 2] & ~STATS_SOLVED_BIT) << 16);
+    if (Stats_Erased(record) ||
+        (!frames && !record[STATS_LASERS] && !record[STATS_MOVES] && !record[STATS_ROTATIONS]))
+      continue; // never played
+    uint32_t seconds = frames / FRAMES_PER_SECOND;
+    printf("%5u %6s %6u %5u %9u %8u %5u:%02u%s\n", level,
+           (record[STATS_SOLVED] & STATS_SOLVED_BIT) ? "yes" : "no",
+           record[STATS_LASERS], record[STATS_MOVES], record[STATS_ROTATIONS],
+           frames, seconds / 60, seconds % 60, (frames == 0x7FFFFF) ? "+" : "");
+  }
+  return 0;
+}
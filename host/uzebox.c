@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <uzebox.h>
+
+struct SpriteStruct sprites[MAX_SPRITES];
+u8 vram[VRAM_TILES_H * VRAM_TILES_V];
+u8 ram_tiles[RAM_TILES_COUNT * TILE_WIDTH * TILE_HEIGHT];
+
+unsigned int host_joypad;
+uint32_t host_vsyncs;
+u8 host_eeprom[2048] = { [0 ... 2047] = 0xff }; // erased, with every block free
+
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIFR0;
+volatile uint16_t SP = RAMEND;
+
+static const char* tile_table;
+static const char* sprite_banks[4];
+static VsyncCallBackFunc pre_vsync;
+static VsyncCallBackFunc post_vsync;
+
+// Video
+
+void ClearVram(void)
+{
+  memset(vram, RAM_TILES_COUNT, sizeof(vram));
+}
+
+void SetTile(char x, char y, unsigned int tileId)
+{
+  vram[(u8)y * VRAM_TILES_H + (u8)x] = (u8)(tileId + RAM_TILES_COUNT);
+}
+
+void SetRamTile(u8 x, u8 y, u8 ramTileNo)
+{
+  vram[y * VRAM_TILES_H + x] = ramTileNo;
+}
+
+void DrawMap(u8 x, u8 y, const VRAM_PTR_TYPE* map)
+{
+  u8 w = (u8)map[0];
+  u8 h = (u8)map[1];
+  for (u8 dy = 0; dy < h; ++dy)
+    for (u8 dx = 0; dx < w; ++dx)
+      SetTile(x + dx, y + dy, (u8)map[2 + dy * w + dx]);
+}
+
+void SetTileTable(const char* data)
+{
+  tile_table = data;
+}
+
+void SetSpritesTileBank(u8 bank, const char* data)
+{
+  sprite_banks[bank & 3] = data;
+}
+
+void MapSprite2(u8 startSprite, const char* map, u8 spriteFlags)
+{
+  u8 w = (u8)map[0];
+  u8 h = (u8)map[1];
+  for (u8 dy = 0; dy < h; ++dy)
+    for (u8 dx = 0; dx < w; ++dx) {
+      u8 x = (spriteFlags & SPRITE_FLIP_X) ? (w - 1 - dx) : dx;
+      sprites[startSprite].tileIndex = (u8)map[2 + dy * w + x];
+      sprites[startSprite].flags = spriteFlags;
+      ++startSprite;
+    }
+}
+
+void MoveSprite(u8 startSprite, u8 x, u8 y, u8 width, u8 height)
+{
+  for (u8 dy = 0; dy < height; ++dy)
+    for (u8 dx = 0; dx < width; ++dx) {
+      sprites[startSprite].x = x + TILE_WIDTH * dx;
+      if ((y + TILE_HEIGHT * dy) > (SCREEN_TILES_V * TILE_HEIGHT))
+        sprites[startSprite].y = OFF_SCREEN;
+      else
+        sprites[startSprite].y = y + TILE_HEIGHT * dy;
+      ++startSprite;
+    }
+}
+
+void SetUserRamTilesCount(u8 count)
+{
+  (void)count;
+}
+
+u8* GetUserRamTile(u8 index)
+{
+  return &ram_tiles[index * TILE_WIDTH * TILE_HEIGHT];
+}
+
+void WaitVsync(int count)
+{
+  while (count-- > 0) {
+    if (pre_vsync)
+      pre_vsync();
+    ++host_vsyncs;
+    if (post_vsync)
+      post_vsync();
+  }
+}
+
+void SetUserPreVsyncCallback(VsyncCallBackFunc func)
+{
+  pre_vsync = func;
+}
+
+void SetUserPostVsyncCallback(VsyncCallBackFunc func)
+{
+  post_vsync = func;
+}
+
+// Input
+
+unsigned int ReadJoypad(unsigned char joypadNo)
+{
+  return joypadNo ? 0 : host_joypad;
+}
+
+// Sound
+
+void InitMusicPlayer(const struct PatchStruct* patchPointersParam) { (void)patchPointersParam; }
+void TriggerNote(unsigned char channel, unsigned char patch, unsigned char note, unsigned char volume) { (void)channel; (void)patch; (void)note; (void)volume; }
+void StartSong(const char* song) { (void)song; }
+void StopSong(void) {}
+void ResumeSong(void) {}
+bool IsSongPlaying(void) { return false; }
+
+// EEPROM, using the kernel's layout of 32 byte blocks that start with a 16-bit id
+
+#define BLOCKS (sizeof(host_eeprom) / sizeof(struct EepromBlockStruct))
+
+char EEPROM_ReadBlock(unsigned int blockId, struct EepromBlockStruct* block)
+{
+  for (unsigned int i = 0; i < BLOCKS; ++i) {
+    const u8* p = &host_eeprom[i * sizeof(struct EepromBlockStruct)];
+    if ((p[0] | (p[1] << 8)) == blockId) {
+      memcpy(block, p, sizeof(struct EepromBlockStruct));
+      return 0;
+    }
+  }
+  return EEPROM_ERROR_BLOCK_NOT_FOUND;
+}
+
+char EEPROM_WriteBlock(struct EepromBlockStruct* block)
+{
+  int free = -1;
+  for (unsigned int i = 0; i < BLOCKS; ++i) {
+    u8* p = &host_eeprom[i * sizeof(struct EepromBlockStruct)];
+    u16 id = p[0] | (p[1] << 8);
+    if (id == block->id) {
+      memcpy(p, block, sizeof(struct EepromBlockStruct));
+      return 0;
+    }
+    if ((id == 0xffff) && (free == -1) && (i != 0)) // block 0 belongs to the kernel
+      free = i;
+  }
+  if (free == -1)
+    return EEPROM_ERROR_BLOCK_NOT_FOUND;
+  memcpy(&host_eeprom[free * sizeof(struct EepromBlockStruct)], block, sizeof(struct EepromBlockStruct));
+  return 0;
+}
+
+uint8_t eeprom_read_byte(const uint8_t* addr) { return host_eeprom[(uintptr_t)addr & E2END]; }
+uint16_t eeprom_read_word(const uint16_t* addr) { return eeprom_read_byte((const uint8_t*)addr) | (eeprom_read_byte((const uint8_t*)addr + 1) << 8); }
+void eeprom_write_byte(uint8_t* addr, uint8_t value) { host_eeprom[(uintptr_t)addr & E2END] = value; }
+void eeprom_write_word(uint16_t* addr, uint16_t value) { eeprom_write_byte((uint8_t*)addr, value & 0xff); eeprom_write_byte((uint8_t*)addr + 1, value >> 8); }
+void eeprom_update_byte(uint8_t* addr, uint8_t value) { eeprom_write_byte(addr, value); }
+
+void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    ((uint8_t*)dst)[i] = eeprom_read_byte((const uint8_t*)src + i);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    eeprom_write_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+}
+
+// Rendering
+
+void Host_Render(u8* framebuffer)
+{
+  // Background: RAM tiles come first, followed by the tile table
+  for (u8 ty = 0; ty < SCREEN_TILES_V; ++ty)
+    for (u8 tx = 0; tx < SCREEN_TILES_H; ++tx) {
+      u8 t = vram[ty * VRAM_TILES_H + tx];
+      const u8* tile = (t < RAM_TILES_COUNT)
+        ? &ram_tiles[t * TILE_WIDTH * TILE_HEIGHT]
+        : (const u8*)&tile_table[(t - RAM_TILES_COUNT) * TILE_WIDTH * TILE_HEIGHT];
+      for (u8 y = 0; y < TILE_HEIGHT; ++y)
+        memcpy(&framebuffer[(ty * TILE_HEIGHT + y) * HOST_SCREEN_WIDTH + tx * TILE_WIDTH],
+               &tile[y * TILE_WIDTH], TILE_WIDTH);
+    }
+
+  /* Sprites are blitted in order, so higher numbered sprites end up on top.
+     The game hides sprites by moving them to x = OFF_SCREEN. */
+  for (u8 i = 0; i < MAX_SPRITES; ++i) {
+    const struct SpriteStruct* s = &sprites[i];
+    const char* bank = sprite_banks[s->flags >> 6];
+    if ((s->x == OFF_SCREEN) || (s->x >= HOST_SCREEN_WIDTH) || (s->y >= HOST_SCREEN_HEIGHT) || !bank)
+      continue;
+    const u8* tile = (const u8*)&bank[s->tileIndex * TILE_WIDTH * TILE_HEIGHT];
+    for (u8 y = 0; y < TILE_HEIGHT; ++y)
+      for (u8 x = 0; x < TILE_WIDTH; ++x) {
+        int px = s->x + x;
+        int py = s->y + y;
+        if ((px >= HOST_SCREEN_WIDTH) || (py >= HOST_SCREEN_HEIGHT))
+          continue;
+        u8 sx = (s->flags & SPRITE_FLIP_X) ? (TILE_WIDTH - 1 - x) : x;
+        u8 sy = (s->flags & SPRITE_FLIP_Y) ? (TILE_HEIGHT - 1 - y) : y;
+        u8 c = tile[sy * TILE_WIDTH + sx];
+        if (c != TRANSLUCENT_COLOR)
+          framebuffer[py * HOST_SCREEN_WIDTH + px] = c;
+      }
+  }
+}
+
+void Host_PixelToRGB(u8 pixel, u8* rgb)
+{
+  rgb[0] = ((pixel >> 0) & 7) * 255 / 7;
+  rgb[1] = ((pixel >> 3) & 7) * 255 / 7;
+  rgb[2] = ((pixel >> 6) & 3) * 255 / 3;
+}
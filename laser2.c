@@ -27,13 +27,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <uzebox.h>
+#ifndef LEVEL_PACK
+#define LEVEL_PACK 0 // normally set from the Makefile
+#endif
+#if LEVEL_PACK
+#include <petitfatfs/pff.h>
+#endif
 
 #include "data/tileset.inc"
 #include "data/sprites.inc"
 #include "data/titlescreen.inc"
 #include "data/patches.inc"
 #include "data/midisong.h"
+#include "data/text.inc"
+#include "data/pieces.inc"
+
+// Debug options, normally set from the Makefile
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+#ifndef STACKMON
+#define STACKMON 0
+#endif
+#ifndef DEBUG_SPRITES
+#define DEBUG_SPRITES 0
+#endif
+#ifndef RECORD
+#define RECORD 0
+#endif
+#ifndef REPLAY
+#define REPLAY 0
+#endif
 
 typedef struct {
   uint16_t held;
@@ -50,42 +76,56 @@ typedef struct {
 
 #define TILE_TITLE_LASER 1
 
-// Defines for the pieces. Rotations are treated as different pieces. Unknown rotations end in _U
-#define P_BLANK 0
-#define P_LASER_T 1
-#define P_LASER_R 2
-#define P_LASER_B 3
-#define P_LASER_L 4
-#define P_LASER_U 5
-#define P_MIRROR_TARGET_OPT_BR 6
-#define P_MIRROR_TARGET_OPT_BL 7
-#define P_MIRROR_TARGET_OPT_TL 8
-#define P_MIRROR_TARGET_OPT_TR 9
-#define P_MIRROR_TARGET_OPT_U 10
-#define P_MIRROR_TARGET_REQ_BR 11
-#define P_MIRROR_TARGET_REQ_BL 12
-#define P_MIRROR_TARGET_REQ_TL 13
-#define P_MIRROR_TARGET_REQ_TR 14
-#define P_MIRROR_TARGET_REQ_U 15
-#define P_SPLIT_TRBL 16
-#define P_SPLIT_TLBR 17
-#define P_SPLIT_U 18
-#define P_DBL_MIRROR_TRBL 19
-#define P_DBL_MIRROR_TLBR 20
-#define P_DBL_MIRROR_U 21
-#define P_CHECKPOINT_TCBC 22
-#define P_CHECKPOINT_LCRC 23
-#define P_CHECKPOINT_U 24
-#define P_CELL_BLOCKER 25
+/* The pieces (P_*) and how they behave are defined in data/pieces.txt.
+   Rotations are treated as different pieces. Unknown rotations end in _U */
+
+/* The size of the board, and how many pieces your "hand" holds.
+   Everything else, including the level format, follows from these. */
+#ifndef BOARD_WIDTH
+#define BOARD_WIDTH 5
+#endif
+#ifndef BOARD_HEIGHT
+#define BOARD_HEIGHT 5
+#endif
+#ifndef HAND_SIZE
+#define HAND_SIZE 5
+#endif
+#define BOARD_CELLS (BOARD_WIDTH * BOARD_HEIGHT)
+#define HAND_ROW BOARD_HEIGHT // a y of HAND_ROW refers to the hand
+
+/* Where the board and the hand are on screen. Each piece is 3x3 tiles,
+   with a one tile gap to the next (where the laser is drawn between
+   them), and the hand lines up with the board's columns. The "move to
+   grid" row is just above the hand. The board goes to the right of the
+   level, targets and prev/next column, and the bottom row of the screen
+   is the level color strip.
+
+   Boards that don't fit with the gaps (6x6 or 7x5, say) are drawn
+   without them, so up to 7x7 with 7 pieces in hand fit. */
+#define PIECE_TILES 3
+#define BOARD_LEFT 9
+#define BOARD_TOP 1
+#define BOARD_COLUMNS ((BOARD_WIDTH > HAND_SIZE) ? BOARD_WIDTH : HAND_SIZE)
+#if (BOARD_LEFT + BOARD_COLUMNS * (PIECE_TILES + 1) - 1 <= SCREEN_TILES_H) && \
+    (BOARD_TOP + BOARD_HEIGHT * (PIECE_TILES + 1) + 2 + PIECE_TILES <= SCREEN_TILES_V - 1)
+#define CELL_GAP 1
+#else
+#define CELL_GAP 0
+#endif
+#define CELL_TILES (PIECE_TILES + CELL_GAP)
+#define HAND_TOP (BOARD_TOP + BOARD_HEIGHT * CELL_TILES + 2)
+#define CELL_TILE_X(x) (BOARD_LEFT + (x) * CELL_TILES)
+#define CELL_TILE_Y(y) (BOARD_TOP + (y) * CELL_TILES)
+
+#if BOARD_LEFT + BOARD_COLUMNS * CELL_TILES - CELL_GAP > SCREEN_TILES_H
+#error "The board or the hand is too wide for the screen"
+#endif
+#if HAND_TOP + PIECE_TILES > SCREEN_TILES_V - 1
+#error "The board and the hand are too tall for the screen"
+#endif
 
 // The configuration of the playing board
-uint8_t board[5][5] = {
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-};
+uint8_t board[BOARD_HEIGHT][BOARD_WIDTH];
 
 /* Each square may have a laser beam going in and/or out in any direction
       IN   OUT
@@ -111,17 +151,18 @@ uint8_t board[5][5] = {
 #define D_IN_R 128
 
 // The bitmap of where the laser is, and which direction(s) it is travelling
-uint8_t laser[5][5] = {
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-  {  0,  0,  0,  0,  0 },
-};
+uint8_t laser[BOARD_HEIGHT][BOARD_WIDTH];
 
 // The pieces in your "hand" (that need to be placed on the board)
-uint8_t hand[5] = { 0, 0, 0, 0, 0 };
+uint8_t hand[HAND_SIZE];
 
+/* Each level is the puzzle and its solution (BOARD_CELLS pieces each,
+   row by row), the pieces in hand, and the number of targets. The ones
+   here are for the default board size. Other sizes get their levels from
+   a level pack, and only have an empty board to fall back on. */
+#define LEVEL_SIZE (2 * BOARD_CELLS + HAND_SIZE + 1)
+
+#if (BOARD_WIDTH == 5) && (BOARD_HEIGHT == 5) && (HAND_SIZE == 5)
 const uint8_t levelData[] PROGMEM = {
   // LEVEL 1
   // Puzzle
@@ -1223,94 +1264,157 @@ const uint8_t levelData[] PROGMEM = {
   0,
 #endif
 };
+#elif LEVEL_PACK
+const uint8_t levelData[LEVEL_SIZE] PROGMEM = { 0 };
+#else
+#error "The levels in levelData are for a 5x5 board with 5 pieces in hand, other sizes need LEVEL_PACK=1"
+#endif
 
-#define LEVEL_SIZE 56
 #define LEVELS (sizeof(levelData) / LEVEL_SIZE)
 
-/* Some pieces are fixed in position, but may be rotated.  These are
-   drawn facing their default directions, but with a rotation overlay
-   sprite, rather than with a padlock overlay sprite. */
-bool NeedsRotationOverlay(uint8_t piece)
+uint8_t levelCount = LEVELS; // the number of levels that can be played
+
+#if LEVEL_PACK
+/*
+ * Level packs
+ *
+ * The levels can also come from LEVELS.DAT on the SD card, so there
+ * can be more of them than fit in flash. The file is made of 512 byte
+ * sectors, and the first one only holds the header:
+ *
+ *   'L', '2', 'P', 'K', board width, board height, hand size, levels
+ *
+ * The levels follow from the second sector on, PACK_LEVELS_PER_SECTOR
+ * to a sector, so that reading one never touches two sectors. A level
+ * is laid out as in levelData, but its pieces (everything except the
+ * targets byte at the end) are packed into 5 bits each, least
+ * significant bit first.
+ *
+ * Only the level being played is unpacked into RAM, and the one after
+ * it is read ahead while the game is idle, so NEXT doesn't wait for the
+ * card. Without a card, or without a pack for this board size, the
+ * levels in flash are played.
+ */
+#define PACK_SECTOR_SIZE 512
+#define PACK_HEADER_SIZE 8
+#define PACK_PIECE_BITS 5
+#define PACK_LEVEL_SIZE (((LEVEL_SIZE - 1) * PACK_PIECE_BITS + 7) / 8 + 1)
+#define PACK_LEVELS_PER_SECTOR (PACK_SECTOR_SIZE / PACK_LEVEL_SIZE)
+#define PACK_MAX_LEVELS 99 // the level number is shown with two digits
+
+#if P_COUNT > (1 << PACK_PIECE_BITS)
+#error "The pieces don't fit in PACK_PIECE_BITS bits any more"
+#endif
+
+FATFS packFs;
+bool packOpen; // whether the levels come from the pack
+uint8_t packLevel[LEVEL_SIZE]; // the level that is being played, unpacked
+uint8_t packLevelNo; // which level packLevel holds, 0 for none
+uint8_t packAhead[PACK_LEVEL_SIZE]; // the last level read from the card
+uint8_t packAheadNo; // which level packAhead holds, 0 for none
+uint8_t packWantNo; // the level to read ahead, 0 for none
+
+/* Switches to the levels in LEVELS.DAT, if there is a card with a pack
+   for this board size. Returns false if the levels in flash are kept. */
+static bool LevelPack_Open(void)
 {
-  return ((piece == P_LASER_U) ||
-          (piece == P_MIRROR_TARGET_OPT_U) ||
-          (piece == P_MIRROR_TARGET_REQ_U) ||
-          (piece == P_SPLIT_U) ||
-          (piece == P_DBL_MIRROR_U) ||
-          (piece == P_CHECKPOINT_U));
+  uint8_t header[PACK_HEADER_SIZE];
+  UINT read;
+  if ((pf_mount(&packFs) != FR_OK) || (pf_open("LEVELS.DAT") != FR_OK) ||
+      (pf_read(header, sizeof(header), &read) != FR_OK) || (read != sizeof(header)))
+    return false;
+  if ((header[0] != 'L') || (header[1] != '2') || (header[2] != 'P') || (header[3] != 'K') ||
+      (header[4] != BOARD_WIDTH) || (header[5] != BOARD_HEIGHT) || (header[6] != HAND_SIZE) ||
+      (header[7] == 0) || (header[7] > PACK_MAX_LEVELS))
+    return false;
+  packOpen = true;
+  packLevelNo = packAheadNo = packWantNo = 0;
+  levelCount = header[7];
+  return true;
 }
 
-/* If a piece is defined as having an unknown rotation, it needs to
-   have its rotate bit set, and a default direction should be
-   chosen. */
-uint8_t DefaultDirection(uint8_t piece)
+/* Reads level n from the card into packAhead. A level that can't be
+   read comes out empty, rather than the game stopping. */
+static void LevelPack_Fetch(uint8_t n)
 {
-  switch (piece) {
-  case P_LASER_U:
-    return P_LASER_B;
-  case P_MIRROR_TARGET_OPT_U:
-    return P_MIRROR_TARGET_OPT_TR;
-  case P_MIRROR_TARGET_REQ_U:
-    return P_MIRROR_TARGET_REQ_TR;
-  case P_SPLIT_U:
-    return P_SPLIT_TLBR;
-  case P_DBL_MIRROR_U:
-    return P_DBL_MIRROR_TLBR;
-  case P_CHECKPOINT_U:
-    return P_CHECKPOINT_TCBC;
-  default:
-    return piece;
+  DWORD offset = (DWORD)(1 + (n - 1) / PACK_LEVELS_PER_SECTOR) * PACK_SECTOR_SIZE +
+                 ((n - 1) % PACK_LEVELS_PER_SECTOR) * PACK_LEVEL_SIZE;
+  UINT read;
+  if ((pf_lseek(offset) != FR_OK) || (pf_read(packAhead, PACK_LEVEL_SIZE, &read) != FR_OK) ||
+      (read != PACK_LEVEL_SIZE))
+    memset(packAhead, 0, sizeof(packAhead));
+  packAheadNo = n;
+}
+
+// Makes level n the one in packLevel, reading it from the card unless it has been read ahead
+static void LevelPack_Load(uint8_t n)
+{
+  if (packAheadNo != n)
+    LevelPack_Fetch(n);
+  uint16_t bits = 0;
+  uint8_t count = 0;
+  const uint8_t* p = packAhead;
+  for (uint8_t i = 0; i < LEVEL_SIZE - 1; ++i) {
+    if (count < PACK_PIECE_BITS) {
+      bits |= (uint16_t)*p++ << count;
+      count += 8;
+    }
+    packLevel[i] = bits & ((1 << PACK_PIECE_BITS) - 1);
+    bits >>= PACK_PIECE_BITS;
+    count -= PACK_PIECE_BITS;
   }
+  packLevel[LEVEL_SIZE - 1] = packAhead[PACK_LEVEL_SIZE - 1];
+  packLevelNo = n;
 }
 
-/* Maps from a numeric piece number to a pointer to the equivalent
-   tilemap. Unknown rotations are not included. They need to have a
-   valid direction. */
-const VRAM_PTR_TYPE* MapName(uint8_t piece)
+// Reads ahead the level that is likely to be played next, during an idle frame
+static void LevelPack_Prefetch(void)
 {
-  switch (piece) {
-  case P_BLANK:
-    return map_blank;
-  case P_LASER_T:
-    return map_laser_t;
-  case P_LASER_R:
-    return map_laser_r;
-  case P_LASER_B:
-    return map_laser_b;
-  case P_LASER_L:
-    return map_laser_l;
-  case P_MIRROR_TARGET_OPT_BR:
-    return map_mirror_target_opt_br;
-  case P_MIRROR_TARGET_OPT_BL:
-    return map_mirror_target_opt_bl;
-  case P_MIRROR_TARGET_OPT_TL:
-    return map_mirror_target_opt_tl;
-  case P_MIRROR_TARGET_OPT_TR:
-    return map_mirror_target_opt_tr;
-  case P_MIRROR_TARGET_REQ_BR:
-    return map_mirror_target_req_br;
-  case P_MIRROR_TARGET_REQ_BL:
-    return map_mirror_target_req_bl;
-  case P_MIRROR_TARGET_REQ_TL:
-    return map_mirror_target_req_tl;
-  case P_MIRROR_TARGET_REQ_TR:
-    return map_mirror_target_req_tr;
-  case P_SPLIT_TRBL:
-    return map_split_trbl;
-  case P_SPLIT_TLBR:
-    return map_split_tlbr;
-  case P_DBL_MIRROR_TRBL:
-    return map_dbl_mirror_trbl;
-  case P_DBL_MIRROR_TLBR:
-    return map_dbl_mirror_tlbr;
-  case P_CHECKPOINT_TCBC:
-    return map_checkpoint_tcbc;
-  case P_CHECKPOINT_LCRC:
-    return map_checkpoint_lcrc;
-  case P_CELL_BLOCKER:
-    return map_cell_blocker;
+  if (packOpen && packWantNo && (packWantNo != packAheadNo))
+    LevelPack_Fetch(packWantNo);
+}
+#endif
+
+// Returns byte i of level n, laid out as in levelData
+static uint8_t LevelByte(uint8_t n, uint8_t i)
+{
+#if LEVEL_PACK
+  if (packOpen) {
+    if (packLevelNo != n)
+      LevelPack_Load(n);
+    return packLevel[i];
   }
-  return map_blank;
+#endif
+  return pgm_read_byte(&levelData[(uint16_t)(n - 1) * LEVEL_SIZE + i]);
+}
+
+// The tilemap of a piece
+static inline const VRAM_PTR_TYPE* MapName(uint8_t piece)
+{
+  return (const VRAM_PTR_TYPE*)pgm_read_ptr(&pieceInfo[piece].map);
+}
+
+/* If a piece is defined as having an unknown rotation, this returns
+   a default direction, otherwise the piece itself */
+static inline uint8_t DefaultDirection(uint8_t piece)
+{
+  return pgm_read_byte(&pieceInfo[piece].direction);
+}
+
+// The board flag that a piece which is part of the initial setup gets
+static inline uint8_t PieceFlags(uint8_t piece)
+{
+  return pgm_read_byte(&pieceInfo[piece].flags);
+}
+
+static inline uint8_t Rotate(uint8_t piece, bool clockwise)
+{
+  return pgm_read_byte(clockwise ? &pieceInfo[piece].clockwise : &pieceInfo[piece].counterClockwise);
+}
+
+static inline uint8_t BeamClass(uint8_t piece)
+{
+  return pgm_read_byte(&pieceInfo[piece].beam);
 }
 
 /*
@@ -1379,769 +1483,1689 @@ static bool BCD_addConstant(uint8_t* const num, const uint8_t digits, uint8_t x)
 // The highest sprite index is for the "mouse cursor"
 // and the 9 highest below that are reserved for drag-and-drop
 #define RESERVED_SPRITES 10
+// The level and targets digits can use 4 RAM tiles, since the targets digit straddles two
+#define DIGIT_RAM_TILES 4
 
-static void LoadLevel(const uint8_t level, bool solution)
-{
-  for (uint8_t i = 0; i < MAX_SPRITES - 1; ++i)
-    sprites[i].x = OFF_SCREEN;
-  
-  ClearVram();
-  
-  // Draw a colored strip along the bottom that corresponds to the level difficulty
-  uint8_t color = TILE_BACKGROUND;
-  if ((level >= 1) && (level <= 15))
-    color = TILE_GREEN;
-  else if ((level >= 16) && (level <= 30))
-    color = TILE_YELLOW;
-  else if ((level >= 31) && (level <= 45))
-    color = TILE_BLUE;
-  else if ((level >= 46) && (level <= 60))
-    color = TILE_RED;
-  for (uint8_t h = 0; h < VRAM_TILES_H; ++h)
-    SetTile(h, VRAM_TILES_V - 1, color);
-  
-  DrawMap(1, 3, map_laser_puzzle_ii);
-  
-  DrawMap(9, 22, map_move_to_grid);
-
-  DrawMap(PREV_NEXT_X, PREV_NEXT_Y, map_prev);
-  DrawMap(PREV_NEXT_X + 2, PREV_NEXT_Y, map_next);
-
-  DrawMap(PREV_NEXT_X + 1, 9, map_level);
-  
-  uint8_t levelDisplay[2] = {0};
-  BCD_addConstant(levelDisplay, 2, level);
-  // Since we ran out of unique background tile indices, we have to resort to using sprites
-  sprites[0].tileIndex = levelDisplay[0] + FIRST_DIGIT_SPRITE;
-  sprites[1].tileIndex = levelDisplay[1] + FIRST_DIGIT_SPRITE;
-  
-  sprites[0].y = 11 * TILE_HEIGHT;
-  sprites[1].y = 11 * TILE_HEIGHT;
-  sprites[0].x = (PREV_NEXT_X + 2) * TILE_WIDTH;
-  sprites[1].x = (PREV_NEXT_X + 1) * TILE_WIDTH;
-
-  
-  const uint16_t levelOffset = (level - 1) * LEVEL_SIZE;
-  
-  DrawMap(PREV_NEXT_X, 17, map_targets);
-  uint8_t targets = pgm_read_byte(&levelData[levelOffset + LEVEL_SIZE - 1]);
-  sprites[2].tileIndex = targets + FIRST_DIGIT_SPRITE;
-  sprites[2].x = (PREV_NEXT_X + 1) * TILE_WIDTH + (TILE_WIDTH / 2);
-  sprites[2].y = 19 * TILE_HEIGHT;
+#if PROFILE || STACKMON
+/* Debug options draw their results with digit sprites that sit just
+   below the ones reserved for drag-and-drop. The Makefile raises
+   MAX_SPRITES by DEBUG_SPRITES to make room for them. */
+#define DEBUG_FIRST_SPRITE (MAX_SPRITES - RESERVED_SPRITES - DEBUG_SPRITES)
 
-  uint8_t currentSprite = 3;
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 5; ++x) {
-      uint8_t piece = (uint8_t)pgm_read_byte(&levelData[(levelOffset + (solution ? 25 : 0)) + y * 5 + x]);
-      bool rotationBit = NeedsRotationOverlay(piece);
-      piece = DefaultDirection(piece);
-      if (rotationBit)
-        board[y][x] = piece | 0x40; // set the rotation bit
-      else
-        board[y][x] = piece | 0x80; // set the lock bit
-      DrawMap(9 + x * 4, 1 + y * 4, MapName(piece));
-      /* Any pieces that are part of the inital setup can't be moved,
-         so add either a lock or rotate icon */
-      if ((piece != P_BLANK) && (currentSprite < (MAX_SPRITES - RESERVED_SPRITES))
-          && (solution == false)) {
-        sprites[currentSprite].tileIndex = rotationBit ? 1 : 0;
-        sprites[currentSprite].x = (11 + x * 4) * TILE_WIDTH;
-        sprites[currentSprite].y = (3 + y * 4) * TILE_HEIGHT;
-        ++currentSprite;
-      }
-    }
-  
-  if (solution) {
-    for (uint8_t x = 0; x < 5; ++x)
-      DrawMap(9 + x * 4, 23, map_blank);
-    return;
+// Draws a number at tile (x, y) using consecutive digit sprites
+static void Debug_Digits(uint8_t sprite, uint8_t x, uint8_t y, uint16_t value, uint8_t digits)
+{
+  uint8_t bcd[3] = {0};
+  while (value > BCD_ADD_CONSTANT_MAX) {
+    BCD_addConstant(bcd, digits, BCD_ADD_CONSTANT_MAX);
+    value -= BCD_ADD_CONSTANT_MAX;
   }
-    
-  for (uint8_t x = 0; x < 5; ++x) {
-    uint8_t piece = (uint8_t)pgm_read_byte(&levelData[(levelOffset + 50) + x]);
-    piece = DefaultDirection(piece);
-    hand[x] = piece;
-    DrawMap(9 + x * 4, 23, MapName(piece));
+  BCD_addConstant(bcd, digits, value);
+  for (uint8_t i = 0; i < digits; ++i) {
+    sprites[sprite + i].tileIndex = bcd[digits - 1 - i] + FIRST_DIGIT_SPRITE;
+    sprites[sprite + i].flags = 0;
+    sprites[sprite + i].x = (x + i) * TILE_WIDTH;
+    sprites[sprite + i].y = y * TILE_HEIGHT;
   }
 }
+#endif
 
-void SimulatePhoton(void)
+#if PROFILE
+/*
+ * Frame-time profiler
+ *
+ * Timer0 is not used by the kernel, so it runs at F_CPU / 1024, which
+ * is about 466 ticks per frame. The vsync callback restarts it and adds
+ * a frame's worth of ticks to profileFrameStart, which gives a 16-bit
+ * tick count without an interrupt of its own (which could delay the
+ * video interrupt). Timer0 only wraps once between two vsyncs, even
+ * though the render interrupt runs with interrupts off for most of a
+ * frame, so its overflow flag is enough to tell whether it did.
+ * The main loop timestamps each of its phases,
+ * and at the end of every frame the total is converted into a
+ * percentage of the frame time. A frame that runs over the next vsync
+ * is counted as missed instead.
+ *
+ * The results are drawn using debug digit sprites in the top left
+ * corner of the screen:
+ *
+ *   row 0: worst frame (%)
+ *   row 1: average frame over the last 64 frames (%)
+ *   row 2: missed vsyncs
+ *   row 3: photons caught in a loop, the last time the laser was on
+ *   row 4: a phase (0 input, 1 beam, 2 draw, 3 sprites), and its worst
+ *          time (% of a frame), moving on to the next phase every 64
+ *          frames
+ */
+#define PROFILE_INPUT 0
+#define PROFILE_BEAM 1
+#define PROFILE_DRAW 2
+#define PROFILE_SPRITES 3
+#define PROFILE_PHASES 4
+
+#define PROFILE_TICKS_PER_FRAME ((uint16_t)(F_CPU / 1024 / 60))
+#define PROFILE_AVERAGE_FRAMES 64
+#define PROFILE_SPRITE_COUNT 12
+#define PROFILE_FIRST_SPRITE DEBUG_FIRST_SPRITE
+
+uint16_t profilePhase[PROFILE_PHASES];      // ticks spent in each phase this frame
+uint16_t profilePhaseWorst[PROFILE_PHASES]; // worst ticks spent in each phase
+uint8_t profileWorst;                       // worst frame (%)
+uint8_t profileAverage;                     // average frame (%)
+uint8_t profileMissed;                      // missed vsyncs (clamped to 99)
+uint16_t profileSum;
+uint8_t profileFrames;
+uint8_t profileShown;                       // the phase shown in row 4
+uint16_t profileLastTick;
+volatile uint16_t profileFrameStart;        // the tick count at the last vsync
+volatile uint8_t profileVsyncs;
+uint8_t profileLoops;
+
+// Restarts Timer0 at a vsync. Called from the vsync callback.
+static void Profile_Vsync(void)
 {
-  // First find where the laser piece is. If it's not on the grid, then don't turn it on.
-  int8_t laser_x = -1;
-  int8_t laser_y = -1;
-  uint8_t laser_d = 0;
-
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 5; ++x)
-      switch (board[y][x] & 0x1F) { // ignore the flag bits
-      case P_LASER_T:
-        laser[y][x] |= D_OUT_T;
-        laser_x = x;
-        laser_y = y - 1;
-        laser_d = D_IN_B;
-        break;
-      case P_LASER_R:
-        laser[y][x] |= D_OUT_R;
-        laser_x = x + 1;
-        laser_y = y;
-        laser_d = D_IN_L;
-        break;
-      case P_LASER_B:
-        laser[y][x] |= D_OUT_B;
-        laser_x = x;
-        laser_y = y + 1;
-        laser_d = D_IN_T;
-        break;
-      case P_LASER_L:
-        laser[y][x] |= D_OUT_L;
-        laser_x = x - 1;
-        laser_y = y;
-        laser_d = D_IN_R;
-        break;
-      }
-  
-  bool bounce = false;
-  bool halt = false;
-  uint8_t ttl = 0;
-  while (!halt && (++ttl != 0) && laser_x >= 0 && laser_x <= 4 && laser_y >= 0 && laser_y <= 4)
-    switch (board[laser_y][laser_x] & 0x1F) { // ignore the flag bits
-    case P_BLANK:
-    case P_CELL_BLOCKER:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_B);
-        laser_y++;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_T);
-        laser_y--;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_R);
-        laser_x++;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_L);
-        laser_x--;
-        break;
-      }
-      break;
+  TCNT0 = 0;
+  TIFR0 = _BV(TOV0); // cleared by writing a one
+  profileFrameStart += PROFILE_TICKS_PER_FRAME;
+  ++profileVsyncs;
+}
 
-    case P_LASER_T:
-    case P_LASER_R:
-    case P_LASER_B:
-    case P_LASER_L:
-      halt = true;
-      break;
+// Returns the 16-bit tick count
+static uint16_t Profile_Ticks(void)
+{
+  uint16_t start;
+  uint8_t low, wrapped;
+  do { // read again if a vsync or an overflow came in between
+    start = profileFrameStart;
+    low = TCNT0;
+    wrapped = TIFR0 & _BV(TOV0);
+  } while ((start != profileFrameStart) || (TCNT0 < low));
+  return start + (wrapped ? 256 : 0) + low;
+}
 
-    case P_MIRROR_TARGET_OPT_BR:
-    case P_MIRROR_TARGET_REQ_BR:
-      switch (laser_d) {
-      case D_IN_T:
-        halt = true;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_R);
-        laser_d = D_IN_L;
-        laser_x++;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= laser_d;
-        halt = true;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_B);
-        laser_d = D_IN_T;
-        laser_y++;
-        break;
-      }
-      break;
+// Starts timing a new frame. Call this right after WaitVsync.
+static void Profile_BeginFrame(void)
+{
+  profileVsyncs = 0;
+  profileLastTick = Profile_Ticks();
+}
 
-    case P_MIRROR_TARGET_OPT_BL:
-    case P_MIRROR_TARGET_REQ_BL:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= laser_d;
-        halt = true;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_L);
-        laser_d = D_IN_R;
-        laser_x--;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_B);
-        laser_d = D_IN_T;
-        laser_y++;
-        break;
-      case D_IN_R:
-        halt = true;
-        break;
-      }
-      break;
+// Charges the time since the last mark to a phase
+static void Profile_Mark(const uint8_t phase)
+{
+  uint16_t now = Profile_Ticks();
+  profilePhase[phase] += now - profileLastTick;
+  profileLastTick = now;
+}
 
-    case P_MIRROR_TARGET_OPT_TL:
-    case P_MIRROR_TARGET_REQ_TL:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_L);
-        laser_d = D_IN_R;
-        laser_x--;
-        break;
-      case D_IN_B:
-        halt = true;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_T);
-        laser_d = D_IN_B;
-        laser_y--;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= laser_d;
-        halt = true;
-        break;
-      }
-      break;
+// Finishes timing the current frame. Call this right before WaitVsync.
+static void Profile_EndFrame(void)
+{
+  uint16_t busy = 0;
+  for (uint8_t i = 0; i < PROFILE_PHASES; ++i) {
+    if (profilePhase[i] > profilePhaseWorst[i])
+      profilePhaseWorst[i] = profilePhase[i];
+    busy += profilePhase[i];
+    profilePhase[i] = 0;
+  }
 
-    case P_MIRROR_TARGET_OPT_TR:
-    case P_MIRROR_TARGET_REQ_TR:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_R);
-        laser_d = D_IN_L;
-        laser_x++;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= laser_d;
-        halt = true;
-        break;
-      case D_IN_L:
-        halt = true;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_T);
-        laser_d = D_IN_B;
-        laser_y--;
-        break;
-      }
-      break;
+  uint8_t percent = 99;
+  if (profileVsyncs) { // we overran at least one vsync
+    if (profileMissed + profileVsyncs < 99)
+      profileMissed += profileVsyncs;
+    else
+      profileMissed = 99;
+  } else if (busy < PROFILE_TICKS_PER_FRAME) {
+    percent = (busy * 100) / PROFILE_TICKS_PER_FRAME;
+  }
 
-    case P_SPLIT_TRBL:
-      // Generate a random number, and decide whether the beam passes through, or bounces
-      bounce = (rand() > (RAND_MAX / 2));
-      switch (laser_d) {
-      case D_IN_T:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_T | D_OUT_L);
-          laser_d = D_IN_R;
-          laser_x--;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_T | D_OUT_B);
-          laser_y++;
-        }
-        break;
-      case D_IN_B:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_B | D_OUT_R);
-          laser_d = D_IN_L;
-          laser_x++;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_B | D_OUT_T);
-          laser_y--;
-        }
-        break;
-      case D_IN_L:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_L | D_OUT_T);
-          laser_d = D_IN_B;
-          laser_y--;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_L | D_OUT_R);
-          laser_x++;
-        }
-        break;
-      case D_IN_R:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_R | D_OUT_B);
-          laser_d = D_IN_T;
-          laser_y++;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_R | D_OUT_L);
-          laser_x--;
-        }
-        break;
-      }
-      break;
+  if (percent > profileWorst)
+    profileWorst = percent;
+  profileSum += percent;
+  if (++profileFrames == PROFILE_AVERAGE_FRAMES) {
+    profileAverage = profileSum / PROFILE_AVERAGE_FRAMES;
+    profileSum = 0;
+    profileFrames = 0;
+    profileShown = (profileShown + 1) % PROFILE_PHASES;
+  }
 
-    case P_SPLIT_TLBR:
-      // Generate a random number, and decide whether the beam passes through, or bounces
-      bounce = (rand() > (RAND_MAX / 2));
-      switch (laser_d) {
-      case D_IN_T:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_T | D_OUT_R);
-          laser_d = D_IN_L;
-          laser_x++;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_T | D_OUT_B);
-          laser_y++;
-        }
-        break;
-      case D_IN_B:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_B | D_OUT_L);
-          laser_d = D_IN_R;
-          laser_x--;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_B | D_OUT_T);
-          laser_y--;
-        }
-        break;
-      case D_IN_L:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_L | D_OUT_B);
-          laser_d = D_IN_T;
-          laser_y++;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_L | D_OUT_R);
-          laser_x++;
-        }
-        break;
-      case D_IN_R:
-        if (bounce) {
-          laser[laser_y][laser_x] |= (D_IN_R | D_OUT_T);
-          laser_d = D_IN_B;
-          laser_y--;
-        } else {
-          laser[laser_y][laser_x] |= (D_IN_R | D_OUT_L);
-          laser_x--;
-        }
-        break;
-      }
-      break;
+  Debug_Digits(PROFILE_FIRST_SPRITE, 1, 0, profileWorst, 2);
+  Debug_Digits(PROFILE_FIRST_SPRITE + 2, 1, 1, profileAverage, 2);
+  Debug_Digits(PROFILE_FIRST_SPRITE + 4, 1, 2, profileMissed, 2);
+  Debug_Digits(PROFILE_FIRST_SPRITE + 6, 1, 3, profileLoops, 3);
+  uint16_t worst = profilePhaseWorst[profileShown];
+  percent = (worst < PROFILE_TICKS_PER_FRAME) ? (worst * 100) / PROFILE_TICKS_PER_FRAME : 99;
+  Debug_Digits(PROFILE_FIRST_SPRITE + 9, 0, 4, profileShown, 1);
+  Debug_Digits(PROFILE_FIRST_SPRITE + 10, 2, 4, percent, 2);
+}
 
-    case P_DBL_MIRROR_TRBL:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_L);
-        laser_d = D_IN_R;
-        laser_x--;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_R);
-        laser_d = D_IN_L;
-        laser_x++;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_T);
-        laser_d = D_IN_B;
-        laser_y--;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_B);
-        laser_d = D_IN_T;
-        laser_y++;
-        break;
-      }
-      break;
+#define PROFILE_BEGIN_FRAME() Profile_BeginFrame()
+#define PROFILE_MARK(phase) Profile_Mark(phase)
+#define PROFILE_END_FRAME() Profile_EndFrame()
+#define PROFILE_LOOPS_RESET() (profileLoops = 0)
+#define PROFILE_LOOP() (++profileLoops)
+#else
+#define PROFILE_SPRITE_COUNT 0
+#define PROFILE_BEGIN_FRAME()
+#define PROFILE_MARK(phase)
+#define PROFILE_END_FRAME()
+#define PROFILE_LOOPS_RESET()
+#define PROFILE_LOOP()
+#endif
 
-    case P_DBL_MIRROR_TLBR:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_R);
-        laser_d = D_IN_L;
-        laser_x++;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_L);
-        laser_d = D_IN_R;
-        laser_x--;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_B);
-        laser_d = D_IN_T;
-        laser_y++;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_T);
-        laser_d = D_IN_B;
-        laser_y--;
-        break;
-      }
-      break;
+#if STACKMON
+/*
+ * Stack high-water mark
+ *
+ * At boot, before .data and .bss are initialized, all of the RAM
+ * between the end of the static data (_end) and the top of the stack
+ * is painted with a canary value. Whenever the stack (including the
+ * kernel's interrupts) grows into that area, it overwrites the
+ * canary, so the first byte above _end that no longer holds the
+ * canary is the deepest the stack has ever reached.
+ *
+ * Each screen repaints the free area when it is entered, so the
+ * deepest stack use is tracked separately per screen. The vsync
+ * callback scans for the high-water mark, which is shown as the
+ * number of bytes that were never touched (row 0, next to the
+ * profiler), and the per-screen results are saved to an EEPROM block
+ * whenever the screen changes:
+ *
+ *   data[0..1]   address of _end (size of the static data)
+ *   data[2..3]   RAMEND
+ *   data[4..11]  deepest stack use in bytes, per screen
+ */
+#define STACKMON_CANARY 0xC5
+#define STACKMON_EEPROM_ID 0x4C53 // debug builds only
+#define STACKMON_SPRITE_COUNT 3
+#define STACKMON_FIRST_SPRITE (DEBUG_FIRST_SPRITE + PROFILE_SPRITE_COUNT)
+
+#define STACKMON_TITLE 0
+#define STACKMON_CONTROLS 1
+#define STACKMON_TOKENS 2
+#define STACKMON_GAME 3
+#define STACKMON_SCREENS 4
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+uint16_t stackDepth[STACKMON_SCREENS]; // deepest stack use per screen
+bool stackDepthChanged;
+volatile uint8_t stackScreen = STACKMON_SCREENS; // not tracking yet
+
+void StackMon_Paint(void) __attribute__ ((naked, used, section (".init1")));
+void StackMon_Paint(void)
+{
+  uint8_t* p = &_end;
+  while (p <= &__stack)
+    *p++ = STACKMON_CANARY;
+}
 
-    case P_CHECKPOINT_TCBC:
-      switch (laser_d) {
-      case D_IN_T:
-        halt = true;
-        break;
-      case D_IN_B:
-        halt = true;
-        break;
-      case D_IN_L:
-        laser[laser_y][laser_x] |= (D_IN_L | D_OUT_R);
-        laser_x++;
-        break;
-      case D_IN_R:
-        laser[laser_y][laser_x] |= (D_IN_R | D_OUT_L);
-        laser_x--;
-        break;
-      }
-      break;
+// Returns the number of bytes above _end that the stack has never touched
+static uint16_t StackMon_Free(void)
+{
+  const uint8_t* p = &_end;
+  while ((p <= &__stack) && (*p == STACKMON_CANARY))
+    ++p;
+  return p - &_end;
+}
 
-    case P_CHECKPOINT_LCRC:
-      switch (laser_d) {
-      case D_IN_T:
-        laser[laser_y][laser_x] |= (D_IN_T | D_OUT_B);
-        laser_y++;
-        break;
-      case D_IN_B:
-        laser[laser_y][laser_x] |= (D_IN_B | D_OUT_T);
-        laser_y--;
-        break;
-      case D_IN_L:
-        halt = true;
-        break;
-      case D_IN_R:
-        halt = true;
-        break;
-      }
-      break;
+// Called from the vsync interrupt
+static void StackMon_Vsync(void)
+{
+  uint8_t screen = stackScreen;
+  if (screen < STACKMON_SCREENS) {
+    uint16_t depth = (&__stack - &_end + 1) - StackMon_Free();
+    if (depth > stackDepth[screen]) {
+      stackDepth[screen] = depth;
+      stackDepthChanged = true;
     }
+  }
 }
 
-void DrawLaser(void)
+static void StackMon_Save(void)
 {
-  /* DrawMap(7, 5, map_laser_source); */
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 5; ++x) {
-      uint8_t l = laser[y][x];
-      switch (board[y][x] & 0x1F) { // ignore the flag bits
-      case P_BLANK:
-        {
-          bool h = ((l & D_IN_L) && (l & D_OUT_R)) || ((l & D_IN_R) && (l & D_OUT_L));
-          bool v = ((l & D_IN_T) && (l & D_OUT_B)) || ((l & D_IN_B) && (l & D_OUT_T));
-          if (h && v)
-            DrawMap(9 + x * 4, 1 + y * 4, map_blank_on_hv);
-          else if (h)
-            DrawMap(9 + x * 4, 1 + y * 4, map_blank_on_h);
-          else if (v)
-            DrawMap(9 + x * 4, 1 + y * 4, map_blank_on_v);
-        }
-        break;
+  struct EepromBlockStruct block;
+  memset(&block, 0, sizeof(block));
+  block.id = STACKMON_EEPROM_ID;
+  uint16_t* data = (uint16_t*)block.data;
+  data[0] = (uint16_t)&_end;
+  data[1] = RAMEND;
+  for (uint8_t i = 0; i < STACKMON_SCREENS; ++i)
+    data[2 + i] = stackDepth[i];
+  EEPROM_WriteBlock(&block);
+}
 
-      case P_CELL_BLOCKER:
-        {
-          bool h = ((l & D_IN_L) && (l & D_OUT_R)) || ((l & D_IN_R) && (l & D_OUT_L));
-          bool v = ((l & D_IN_T) && (l & D_OUT_B)) || ((l & D_IN_B) && (l & D_OUT_T));
-          if (h && v)
-            DrawMap(9 + x * 4, 1 + y * 4, map_cell_blocker_on_hv);
-          else if (h)
-            DrawMap(9 + x * 4, 1 + y * 4, map_cell_blocker_on_h);
-          else if (v)
-            DrawMap(9 + x * 4, 1 + y * 4, map_cell_blocker_on_v);
-        }
-        break;
+// Starts tracking the stack use of a new screen
+static void StackMon_Enter(const uint8_t screen)
+{
+  stackScreen = STACKMON_SCREENS; // stop the vsync scan while repainting
+  if (stackDepthChanged) {
+    stackDepthChanged = false;
+    StackMon_Save();
+  }
+  // Everything below the current stack pointer is free
+  uint8_t* p = &_end;
+  uint8_t* sp = (uint8_t*)SP;
+  while (p < sp)
+    *p++ = STACKMON_CANARY;
+  stackScreen = screen;
+}
 
-      case P_LASER_T:
-        if (l & D_OUT_T)
-          DrawMap(9 + x * 4, 1 + y * 4, map_laser_on_t);
-        break;
+static void StackMon_EndFrame(void)
+{
+  Debug_Digits(STACKMON_FIRST_SPRITE, 4, 0, StackMon_Free(), 3);
+}
 
-      case P_LASER_R:
-        if (l & D_OUT_R)
-          DrawMap(9 + x * 4, 1 + y * 4, map_laser_on_r);
-        break;
+#define STACKMON_ENTER(screen) StackMon_Enter(screen)
+#define STACKMON_END_FRAME() StackMon_EndFrame()
+#else
+#define STACKMON_SPRITE_COUNT 0
+#define STACKMON_ENTER(screen)
+#define STACKMON_END_FRAME()
+#endif
 
-      case P_LASER_B:
-        if (l & D_OUT_B)
-          DrawMap(9 + x * 4, 1 + y * 4, map_laser_on_b);
-        break;
+#if PROFILE || STACKMON
+#if DEBUG_SPRITES < (PROFILE_SPRITE_COUNT + STACKMON_SPRITE_COUNT)
+#error "DEBUG_SPRITES is too small for the enabled debug options"
+#endif
 
-      case P_LASER_L:
-        if (l & D_OUT_L)
-          DrawMap(9 + x * 4, 1 + y * 4, map_laser_on_l);
-        break;
+static void Debug_Vsync(void)
+{
+#if PROFILE
+  Profile_Vsync();
+#endif
+#if STACKMON
+  StackMon_Vsync();
+#endif
+}
 
-      case P_MIRROR_TARGET_OPT_BR:
-      case P_MIRROR_TARGET_REQ_BR:
-        {
-          bool mirror_on = (((l & D_IN_B) && (l & D_OUT_R)) ||
-                            ((l & D_IN_R) && (l & D_OUT_B)));
-          bool target_on = (l & D_IN_L);
-          if (mirror_on && target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_on_br);
-          else if (mirror_on) {
-            if ((board[y][x] & 0x1F) == P_MIRROR_TARGET_OPT_BR)
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_opt_br);
-            else
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_req_br);
-          } else if (target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_target_on_br);
-        }
-        break;
+static void Debug_Init(void)
+{
+#if PROFILE
+  TCCR0A = 0;
+  TCCR0B = _BV(CS02) | _BV(CS00); // F_CPU / 1024
+#endif
+}
 
-      case P_MIRROR_TARGET_OPT_BL:
-      case P_MIRROR_TARGET_REQ_BL:
-        {
-          bool mirror_on = (((l & D_IN_B) && (l & D_OUT_L)) ||
-                            ((l & D_IN_L) && (l & D_OUT_B)));
-          bool target_on = (l & D_IN_T);
-          if (mirror_on && target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_on_bl);
-          else if (mirror_on) {
-            if ((board[y][x] & 0x1F) == P_MIRROR_TARGET_OPT_BL)
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_opt_bl);
-            else
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_req_bl);
-          } else if (target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_target_on_bl);
-        }
-        break;
-        
-      case P_MIRROR_TARGET_OPT_TL:
-      case P_MIRROR_TARGET_REQ_TL:
-        {
-          bool mirror_on = (((l & D_IN_T) && (l & D_OUT_L)) ||
-                            ((l & D_IN_L) && (l & D_OUT_T)));
-          bool target_on = (l & D_IN_R);
-          if (mirror_on && target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_on_tl);
-          else if (mirror_on) {
-            if ((board[y][x] & 0x1F) == P_MIRROR_TARGET_OPT_TL)
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_opt_tl);
-            else
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_req_tl);
-          } else if (target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_target_on_tl);
+#define DEBUG_INIT() Debug_Init()
+// Called from the game's vsync callback, VramQueue_Vsync
+#define DEBUG_VSYNC() Debug_Vsync()
+#else
+#define DEBUG_INIT()
+#define DEBUG_VSYNC()
+#endif
+
+// The id of an EEPROM block that no game is using
+#define FREE_BLOCK_ID 0xFFFF
+
+// The EEPROM address of the block with an id, or 0 if there is none
+static uint16_t FindEepromBlock(uint16_t id)
+{
+  // Block 0 belongs to the kernel
+  for (uint16_t address = sizeof(struct EepromBlockStruct); address < E2END; address += sizeof(struct EepromBlockStruct))
+    if (eeprom_read_word((const uint16_t*)(uintptr_t)address) == id)
+      return address;
+  return 0;
+}
+
+#if RECORD || REPLAY
+/*
+ * Input recording and replay
+ *
+ * RECORD=1 logs the value returned by every ReadJoypad(0) call in the
+ * game, starting from power-on, to the EEPROM. The log is run-length
+ * encoded as 3 byte records:
+ *
+ *   count (1-255), buttons (low byte), buttons (high byte)
+ *
+ * and a count of 0 ends the log. The records live in the data area
+ * of up to REPLAY_SLOTS EEPROM blocks with the ids REPLAY_EEPROM_ID,
+ * REPLAY_EEPROM_ID + 1, ... wherever the kernel's block functions would
+ * put them. Each block holds exactly 10 records. Recording reuses the
+ * blocks of the last log, and only claims a free block when the log
+ * fills the ones it has, so the saves of other games (and of this one)
+ * are left alone, and find as much room as in a release build. The log
+ * is cut short if the EEPROM runs out of free blocks, and if there are
+ * none at all, nothing is recorded and the intro screen says so.
+ * Writes are queued and written one byte at a time when the EEPROM is
+ * ready, so recording does not stall the game.
+ *
+ * REPLAY=1 feeds the log back in place of the joypad, and switches to
+ * the real joypad once it runs out. The random number generator is
+ * seeded the same way in both builds, and the game only advances when
+ * it reads input, so replays are frame-exact.
+ */
+#if RECORD && REPLAY
+#error "RECORD and REPLAY can not be used at the same time"
+#endif
+
+#define REPLAY_SEED 1
+#define REPLAY_EEPROM_ID 0x4C00 // debug builds only, uses ids 0x4C00-0x4C1F
+#define REPLAY_SLOTS 32
+#define REPLAY_SLOT_SIZE sizeof(struct EepromBlockStruct)
+#define REPLAY_SLOT_DATA (REPLAY_SLOT_SIZE - 2)
+#define REPLAY_RECORD_SIZE 3
+
+uint16_t replayButtons;
+uint8_t replayCount;
+uint16_t replayOffset; // offset of the current record in the log
+uint16_t replaySize; // the size of the log, for the blocks it has
+uint16_t replaySlot[REPLAY_SLOTS]; // the EEPROM address of each block of the log
+
+// Maps an offset within the log to an EEPROM address
+static uint16_t Replay_Address(const uint16_t offset)
+{
+  return replaySlot[offset / REPLAY_SLOT_DATA] + 2 + (offset % REPLAY_SLOT_DATA);
+}
+
+// Finds the blocks of the log, up to the first one that is missing
+static void Replay_FindSlots(void)
+{
+  uint8_t slot = 0;
+  for (; slot < REPLAY_SLOTS; ++slot) {
+    uint16_t address = FindEepromBlock(REPLAY_EEPROM_ID + slot);
+    if (!address)
+      break;
+    replaySlot[slot] = address;
+  }
+  replaySize = slot * REPLAY_SLOT_DATA;
+}
+#endif
+
+#if RECORD
+#define RECORD_QUEUE_SIZE 8 // must be a power of 2
+
+uint16_t recordQueueAddress[RECORD_QUEUE_SIZE];
+uint8_t recordQueueValue[RECORD_QUEUE_SIZE];
+uint8_t recordHead;
+uint8_t recordTail;
+bool recordFull;
+
+// Writes at most one queued byte, unless the EEPROM is still busy
+static void Record_Service(void)
+{
+  if ((recordHead != recordTail) && eeprom_is_ready()) {
+    uint8_t i = recordTail++ & (RECORD_QUEUE_SIZE - 1);
+    eeprom_write_byte((uint8_t*)(uintptr_t)recordQueueAddress[i], recordQueueValue[i]);
+  }
+}
+
+static void Record_Queue(const uint16_t offset, const uint8_t value)
+{
+  while ((uint8_t)(recordHead - recordTail) == RECORD_QUEUE_SIZE) {
+    eeprom_busy_wait();
+    Record_Service();
+  }
+  uint8_t i = recordHead++ & (RECORD_QUEUE_SIZE - 1);
+  recordQueueAddress[i] = Replay_Address(offset);
+  recordQueueValue[i] = value;
+}
+
+/* Gives a free block the id of the next block of the log. Returns false
+   if there is none, or the log already has REPLAY_SLOTS blocks. */
+static bool Record_Claim(void)
+{
+  uint8_t slot = replaySize / REPLAY_SLOT_DATA;
+  uint16_t address = (slot < REPLAY_SLOTS) ? FindEepromBlock(FREE_BLOCK_ID) : 0;
+  if (!address)
+    return false;
+  eeprom_write_word((uint16_t*)(uintptr_t)address, REPLAY_EEPROM_ID + slot); // waits for the EEPROM
+  replaySlot[slot] = address;
+  replaySize += REPLAY_SLOT_DATA;
+  return true;
+}
+
+static void Record_Init(void)
+{
+  Replay_FindSlots();
+  if (replaySize || Record_Claim())
+    eeprom_write_byte((uint8_t*)(uintptr_t)Replay_Address(0), 0); // empty log
+  else
+    recordFull = true; // no room for a log at all
+}
+
+// Appends the current run to the log, followed by a new end marker
+static void Record_Flush(void)
+{
+  if (recordFull || (replayCount == 0))
+    return;
+  Record_Queue(replayOffset + 1, replayButtons & 0xFF);
+  Record_Queue(replayOffset + 2, replayButtons >> 8);
+  Record_Queue(replayOffset, replayCount);
+  replayOffset += REPLAY_RECORD_SIZE;
+  if ((replayOffset == replaySize) && !Record_Claim())
+    recordFull = true; // no room for an end marker
+  else
+    Record_Queue(replayOffset, 0);
+  replayCount = 0;
+}
+
+static uint16_t ReadInput(void)
+{
+  uint16_t held = ReadJoypad(0);
+  if ((held != replayButtons) || (replayCount == 255))
+    Record_Flush();
+  replayButtons = held;
+  ++replayCount;
+  Record_Service();
+  return held;
+}
+
+#define INPUT_INIT() do { srand(REPLAY_SEED); Record_Init(); } while (0)
+#elif REPLAY
+// Loads the next record, or returns false if the log has ended
+static bool Replay_Next(void)
+{
+  if (replayOffset == replaySize)
+    return false;
+  replayCount = eeprom_read_byte((const uint8_t*)(uintptr_t)Replay_Address(replayOffset));
+  replayButtons = eeprom_read_word((const uint16_t*)(uintptr_t)Replay_Address(replayOffset + 1));
+  replayOffset += REPLAY_RECORD_SIZE;
+  return (replayCount != 0);
+}
+
+static uint16_t ReadInput(void)
+{
+  if ((replayCount == 0) && !Replay_Next()) {
+    replayOffset = replaySize; // stay on the joypad from now on
+    return ReadJoypad(0);
+  }
+  --replayCount;
+  return replayButtons;
+}
+
+#define INPUT_INIT() do { srand(REPLAY_SEED); Replay_FindSlots(); } while (0)
+#else
+static inline uint16_t ReadInput(void)
+{
+  return ReadJoypad(0);
+}
+
+#define INPUT_INIT()
+#endif
+
+// The color of the difficulty strip that is currently on screen
+uint8_t levelColor;
+
+// Whether fixed pieces get a padlock or rotate icon (not in the solution view)
+bool showOverlays;
+// How many user RAM tiles the overlays are using
+uint8_t overlayCount;
+/* The most overlays there can be, leaving RAM tiles for the digits and
+   a dragged piece that snaps to the grid (see MoveDragSprites), if not
+   for debug sprites. A big board can have more fixed pieces than that,
+   and the ones past it go without an icon. */
+#define OVERLAY_MAX (RAM_TILES_COUNT - DIGIT_RAM_TILES - 9)
+
+/* Draws a padlock or rotate icon over the bottom right tile of every
+   fixed piece. Instead of using a sprite for each one, which the kernel
+   would blit every frame, the icon is composited once into a user RAM
+   tile on top of the flash tile the piece has there. There is no room
+   left in the tileset for pre-composited tiles. Corners that still show
+   their RAM tile haven't been redrawn, so they are left alone. */
+static void DrawOverlays(void)
+{
+  uint8_t count = 0;
+  if (showOverlays)
+    for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+      for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+        if ((board[y][x] & (PF_LOCK | PF_ROTATE)) && ((board[y][x] & 0x1F) != P_BLANK) && (count < OVERLAY_MAX))
+          ++count;
+  // Claim the RAM tiles before writing them, so no sprite is using them
+  SetUserRamTilesCount(count);
+  overlayCount = count;
+  if (!count)
+    return;
+
+  uint8_t ramTileNo = 0;
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x) {
+      if (!(board[y][x] & (PF_LOCK | PF_ROTATE)) || ((board[y][x] & 0x1F) == P_BLANK) || (ramTileNo == count))
+        continue;
+      uint8_t* corner = &vram[(CELL_TILE_Y(y) + 2) * VRAM_TILES_H + CELL_TILE_X(x) + 2];
+      if (*corner >= RAM_TILES_COUNT) {
+        const char* tile = &tileset[(*corner - RAM_TILES_COUNT) * TILE_WIDTH * TILE_HEIGHT];
+        const char* icon = &mysprites[((board[y][x] & PF_ROTATE) ? 1 : 0) * TILE_WIDTH * TILE_HEIGHT];
+        uint8_t* ramTile = GetUserRamTile(ramTileNo);
+        for (uint8_t i = 0; i < TILE_WIDTH * TILE_HEIGHT; ++i) {
+          uint8_t px = (uint8_t)pgm_read_byte(&icon[i]);
+          ramTile[i] = (px == TRANSLUCENT_COLOR) ? (uint8_t)pgm_read_byte(&tile[i]) : px;
         }
+        *corner = ramTileNo;
+      }
+      ++ramTileNo;
+    }
+}
+
+/*
+ * VRAM update queue
+ *
+ * Drawing a whole board in the middle of a frame shows it half drawn,
+ * so the board, the hand and the laser are not drawn straight into
+ * VRAM. Their maps and tiles are queued, and the vsync callback writes
+ * at most VRAM_QUEUE_BUDGET tiles of them per frame, in order, during
+ * the vertical blank. Whatever doesn't fit is left for the next frame,
+ * so a full board takes 4 frames. When the queue is full, the game
+ * waits for a frame to make room.
+ *
+ * DrawOverlays reads the corners back from VRAM, so it is queued as
+ * well, and runs once the maps in front of it have been written.
+ */
+#define VRAM_QUEUE_SIZE 16 // must be a power of 2
+#define VRAM_QUEUE_BUDGET 72 // tiles per frame, i.e. 8 cells
+#define VRAM_QUEUE_TILE 0x80 // set in x when the entry is a tile, not a map
+#define VRAM_QUEUE_OVERLAYS 0xFF // the x of an entry that runs DrawOverlays
+#define VRAM_QUEUE_OVERLAYS_COST 9 // about as long as writing a cell
+
+typedef struct {
+  uint8_t x;
+  uint8_t y;
+  union {
+    const VRAM_PTR_TYPE* map;
+    uint8_t tile;
+  };
+} VRAM_UPDATE;
+
+volatile VRAM_UPDATE vramQueue[VRAM_QUEUE_SIZE];
+volatile uint8_t vramQueueHead;
+volatile uint8_t vramQueueTail;
+
+static void VramQueue_Vsync(void)
+{
+  uint8_t budget = VRAM_QUEUE_BUDGET;
+  while (vramQueueHead != vramQueueTail) {
+    volatile VRAM_UPDATE* u = &vramQueue[vramQueueTail & (VRAM_QUEUE_SIZE - 1)];
+    uint8_t cost;
+    if (u->x == VRAM_QUEUE_OVERLAYS)
+      cost = VRAM_QUEUE_OVERLAYS_COST;
+    else if (u->x & VRAM_QUEUE_TILE)
+      cost = 1;
+    else
+      cost = (uint8_t)pgm_read_byte(&u->map[0]) * (uint8_t)pgm_read_byte(&u->map[1]);
+    // Anything too big for a single frame gets one to itself
+    if ((cost > budget) && (budget != VRAM_QUEUE_BUDGET))
+      break;
+    budget = (cost > budget) ? 0 : budget - cost;
+
+    if (u->x == VRAM_QUEUE_OVERLAYS)
+      DrawOverlays();
+    else if (u->x & VRAM_QUEUE_TILE)
+      SetTile(u->x & ~VRAM_QUEUE_TILE, u->y, u->tile);
+    else
+      DrawMap(u->x, u->y, u->map);
+    ++vramQueueTail;
+  }
+  DEBUG_VSYNC();
+}
+
+// Returns the next free entry, waiting for the vsync callback to make room
+static volatile VRAM_UPDATE* VramQueue_Next(void)
+{
+  while ((uint8_t)(vramQueueHead - vramQueueTail) == VRAM_QUEUE_SIZE)
+    WaitVsync(1);
+  return &vramQueue[vramQueueHead & (VRAM_QUEUE_SIZE - 1)];
+}
+
+static void VramQueue_Map(uint8_t x, uint8_t y, const VRAM_PTR_TYPE* map)
+{
+  volatile VRAM_UPDATE* u = VramQueue_Next();
+  u->x = x;
+  u->y = y;
+  u->map = map;
+  ++vramQueueHead;
+}
+
+#if CELL_GAP // only the gaps between cells are drawn a tile at a time
+static void VramQueue_Tile(uint8_t x, uint8_t y, uint8_t tile)
+{
+  volatile VRAM_UPDATE* u = VramQueue_Next();
+  u->x = x | VRAM_QUEUE_TILE;
+  u->y = y;
+  u->tile = tile;
+  ++vramQueueHead;
+}
+#endif
+
+static void VramQueue_Overlays(void)
+{
+  VramQueue_Next()->x = VRAM_QUEUE_OVERLAYS;
+  ++vramQueueHead;
+}
+
+// Waits until everything that was queued is on screen
+static void VramQueue_Drain(void)
+{
+  while (vramQueueHead != vramQueueTail)
+    WaitVsync(1);
+}
+
+/*
+ * Play statistics
+ *
+ * For each level in flash, the EEPROM keeps how often the laser was
+ * fired, how many pieces were moved and rotated, and how many frames
+ * were played, up to the first time the level was solved, and whether
+ * it has been. host/stats decodes them from an emulator's EEPROM file.
+ *
+ * A record is STATS_RECORD_SIZE bytes, STATS_LEVELS_PER_BLOCK of them
+ * to an EEPROM block with the id STATS_EEPROM_ID + (level - 1) /
+ * STATS_LEVELS_PER_BLOCK. A block is only claimed from the free ones
+ * when one of its levels is loaded for the first time, and it is then
+ * cleared one byte per frame. A record that still reads as all 0xFF
+ * (the block was never cleared) hasn't been played.
+ *
+ * The record of the level being played is counted in RAM, and is only
+ * written once a minute, when the level is solved, and when another
+ * level is loaded. Then only the bytes that changed are written, one
+ * per frame, so the EEPROM wears slowly and the game doesn't wait for
+ * it, except when the level changes and whatever is left is written.
+ * Once a level is solved, its record doesn't change any more.
+ */
+#define STATS_EEPROM_ID 0x4C60 // uses ids 0x4C60-0x4C6B
+#define STATS_MAX_LEVELS 60
+#define STATS_RECORD_SIZE 6
+#define STATS_LEVELS_PER_BLOCK ((sizeof(struct EepromBlockStruct) - 2) / STATS_RECORD_SIZE)
+#define STATS_FLUSH_FRAMES 3600 // a minute
+
+// The bytes of a record
+#define STATS_LASERS 0 // how often Y turned the laser on, up to 255
+#define STATS_MOVES 1 // pieces dropped in another cell, up to 255
+#define STATS_ROTATIONS 2 // quarter turns, up to 255
+#define STATS_FRAMES 3 // 23 bits, least significant byte first, up to 0x7FFFFF
+#define STATS_SOLVED 5 // the top bit of the frames
+#define STATS_SOLVED_BIT 0x80
+
+uint8_t statsLevel; // which level stats belongs to, 0 for none
+uint16_t statsAddress; // where its record is in the EEPROM
+uint8_t stats[STATS_RECORD_SIZE]; // the record, as it is counted
+uint8_t statsSaved[STATS_RECORD_SIZE]; // the record, as it is (being) written
+uint8_t statsDirty; // which bytes of statsSaved still have to be written
+uint16_t statsTimer = STATS_FLUSH_FRAMES; // frames until the record is written again
+uint16_t statsClear; // the next byte of a claimed block to clear
+uint16_t statsClearEnd; // the end of that block, or statsClear if there is nothing to clear
+
+// Whether a record was never written, as in a block that wasn't cleared
+static bool Stats_Erased(const uint8_t* record)
+{
+  for (uint8_t i = 0; i < STATS_RECORD_SIZE; ++i)
+    if (record[i] != 0xFF)
+      return false;
+  return true;
+}
+
+// Takes what has been counted since the last time, to be written by Stats_Service
+static void Stats_Flush(void)
+{
+  statsTimer = STATS_FLUSH_FRAMES;
+  if (!statsLevel)
+    return;
+  for (uint8_t i = 0; i < STATS_RECORD_SIZE; ++i)
+    if (stats[i] != statsSaved[i]) {
+      statsSaved[i] = stats[i];
+      statsDirty |= 1 << i;
+    }
+}
+
+/* Writes at most one byte, unless the EEPROM is still busy: the block
+   that is being cleared comes first, then the record. Returns false
+   once there is nothing left to write. */
+static bool Stats_Service(void)
+{
+  if (!eeprom_is_ready())
+    return true;
+  if (statsClear != statsClearEnd) {
+    eeprom_write_byte((uint8_t*)(uintptr_t)statsClear++, 0);
+    return true;
+  }
+  if (statsDirty) {
+    uint8_t i = 0;
+    while (!(statsDirty & (1 << i)))
+      ++i;
+    eeprom_write_byte((uint8_t*)(uintptr_t)(statsAddress + i), statsSaved[i]);
+    statsDirty &= ~(1 << i);
+    return true;
+  }
+  return false;
+}
+
+// Switches to the record of another level, saving the one before
+static void Stats_Enter(uint8_t level)
+{
+  if (level == statsLevel)
+    return;
+  Stats_Flush();
+  while (Stats_Service())
+    ; // waits for the EEPROM, as the level changes
+#if LEVEL_PACK
+  if (packOpen)
+    level = 0;
+#endif
+  if (level > STATS_MAX_LEVELS)
+    level = 0;
+  statsLevel = 0;
+  memset(stats, 0, sizeof(stats));
+  memset(statsSaved, 0, sizeof(statsSaved));
+  if (!level)
+    return;
+
+  uint16_t id = STATS_EEPROM_ID + (level - 1) / STATS_LEVELS_PER_BLOCK;
+  uint16_t block = FindEepromBlock(id);
+  if (!block) {
+    block = FindEepromBlock(FREE_BLOCK_ID);
+    if (!block)
+      return; // the EEPROM is full, so the statistics are lost
+    eeprom_write_word((uint16_t*)(uintptr_t)block, id); // waits for the EEPROM
+    statsClear = block + 2;
+    statsClearEnd = block + sizeof(struct EepromBlockStruct);
+  }
+  statsLevel = level;
+  statsAddress = block + 2 + ((level - 1) % STATS_LEVELS_PER_BLOCK) * STATS_RECORD_SIZE;
+  if (statsClear == statsClearEnd) {
+    eeprom_read_block(stats, (const void*)(uintptr_t)statsAddress, STATS_RECORD_SIZE);
+    if (Stats_Erased(stats))
+      memset(stats, 0, sizeof(stats));
+    memcpy(statsSaved, stats, sizeof(stats));
+  }
+}
+
+static inline bool Stats_Counting(void)
+{
+  return statsLevel && !(stats[STATS_SOLVED] & STATS_SOLVED_BIT);
+}
+
+// Adds one to a counter of the record, unless it is full
+static void Stats_Count(uint8_t counter)
+{
+  if (Stats_Counting() && (stats[counter] != 0xFF))
+    ++stats[counter];
+}
+
+// Counts a frame of play, and writes the record every STATS_FLUSH_FRAMES
+static void Stats_Frame(void)
+{
+  if (Stats_Counting() && !++stats[STATS_FRAMES] && !++stats[STATS_FRAMES + 1] &&
+      (++stats[STATS_FRAMES + 2] & STATS_SOLVED_BIT)) {
+    // Full, so it stays at 0x7FFFFF
+    stats[STATS_FRAMES] = stats[STATS_FRAMES + 1] = 0xFF;
+    stats[STATS_FRAMES + 2] = 0x7F;
+  }
+  if (!--statsTimer)
+    Stats_Flush();
+  Stats_Service();
+}
+
+static void Stats_Solved(void)
+{
+  if (statsLevel)
+    stats[STATS_SOLVED] |= STATS_SOLVED_BIT;
+  Stats_Flush();
+}
+
+/*
+ * Undo journal
+ *
+ * Every edit the player makes to the board or the hand is one 16-bit
+ * entry in a ring buffer: the cell the piece came from, the cell it
+ * ended up in (the same one for a rotation in place), and how many
+ * quarter turns clockwise it was rotated on the way. Cells are numbered
+ * row by row across the board, and then along the hand. Undo and redo
+ * move the piece back or forth and queue just the cells that changed,
+ * like the player's own edits do. Once the buffer is full, the oldest
+ * edits are forgotten. The journal is cleared whenever a level is loaded.
+ */
+#define JOURNAL_SIZE 16 // must be a power of 2
+#define JOURNAL_CELL_BITS 7
+#define JOURNAL_EDIT(from, to, turns) \
+  ((uint16_t)(from) | ((uint16_t)(to) << JOURNAL_CELL_BITS) | ((uint16_t)(turns) << (2 * JOURNAL_CELL_BITS)))
+#define JOURNAL_FROM(edit) ((edit) & ((1 << JOURNAL_CELL_BITS) - 1))
+#define JOURNAL_TO(edit) (((edit) >> JOURNAL_CELL_BITS) & ((1 << JOURNAL_CELL_BITS) - 1))
+#define JOURNAL_TURNS(edit) ((edit) >> (2 * JOURNAL_CELL_BITS))
+
+#if BOARD_CELLS + HAND_SIZE > (1 << JOURNAL_CELL_BITS)
+#error "The cells don't fit in JOURNAL_CELL_BITS bits any more"
+#endif
+
+uint16_t journal[JOURNAL_SIZE];
+uint8_t journalHead; // where the next edit goes
+uint8_t journalUndos; // how many edits before journalHead can be undone
+uint8_t journalRedos; // how many edits from journalHead on can be redone
+
+// The cell number of a board cell, or of a hand cell if y is HAND_ROW
+static inline uint8_t CellNo(int8_t x, int8_t y)
+{
+  return (y == HAND_ROW) ? BOARD_CELLS + x : y * BOARD_WIDTH + x;
+}
+
+static inline uint8_t* CellPiece(uint8_t cell)
+{
+  return (cell < BOARD_CELLS) ? &board[cell / BOARD_WIDTH][cell % BOARD_WIDTH] : &hand[cell - BOARD_CELLS];
+}
+
+// Queues a cell to be redrawn with the piece that is in it now
+static void DrawCell(uint8_t cell)
+{
+  if (cell < BOARD_CELLS)
+    VramQueue_Map(CELL_TILE_X(cell % BOARD_WIDTH), CELL_TILE_Y(cell / BOARD_WIDTH), MapName(*CellPiece(cell) & 0x1F));
+  else
+    VramQueue_Map(CELL_TILE_X(cell - BOARD_CELLS), HAND_TOP, MapName(*CellPiece(cell)));
+}
+
+static void Journal_Clear(void)
+{
+  journalUndos = journalRedos = 0;
+}
+
+// Remembers an edit that has just been made, which can't be redone any more
+static void Journal_Record(uint8_t from, uint8_t to, uint8_t turns)
+{
+  turns &= 3;
+  if ((from == to) && !turns)
+    return;
+  if (from != to)
+    Stats_Count(STATS_MOVES);
+  journal[journalHead] = JOURNAL_EDIT(from, to, turns);
+  journalHead = (journalHead + 1) & (JOURNAL_SIZE - 1);
+  if (journalUndos < JOURNAL_SIZE)
+    ++journalUndos;
+  journalRedos = 0;
+}
+
+/* Moves the piece in one cell to another, turning it along the way. The
+   lock and rotate bits stay with the piece, which can only matter for a
+   rotation in place, as fixed pieces can't be dragged. */
+static void Journal_Move(uint8_t from, uint8_t to, uint8_t turns, bool clockwise)
+{
+  uint8_t* cell = CellPiece(from);
+  uint8_t piece = *cell;
+  *cell = P_BLANK;
+  for (; turns; --turns)
+    piece = (piece & (PF_LOCK | PF_ROTATE)) | Rotate(piece & 0x1F, clockwise);
+  *CellPiece(to) = piece;
+
+  DrawCell(from);
+  if (to != from)
+    DrawCell(to);
+  if (piece & (PF_LOCK | PF_ROTATE))
+    VramQueue_Overlays();
+}
+
+static bool Journal_Undo(void)
+{
+  if (!journalUndos)
+    return false;
+  journalHead = (journalHead - 1) & (JOURNAL_SIZE - 1);
+  uint16_t edit = journal[journalHead];
+  Journal_Move(JOURNAL_TO(edit), JOURNAL_FROM(edit), JOURNAL_TURNS(edit), false);
+  --journalUndos;
+  ++journalRedos;
+  return true;
+}
+
+static bool Journal_Redo(void)
+{
+  if (!journalRedos)
+    return false;
+  uint16_t edit = journal[journalHead];
+  Journal_Move(JOURNAL_FROM(edit), JOURNAL_TO(edit), JOURNAL_TURNS(edit), true);
+  journalHead = (journalHead + 1) & (JOURNAL_SIZE - 1);
+  ++journalUndos;
+  --journalRedos;
+  return true;
+}
+
+/*
+ * Share codes
+ *
+ * A share code is a level and the player's arrangement of it, in
+ * letters that can be read off the screen and typed back in, on this
+ * Uzebox or another one (host/sharecode reads them as well). Only what
+ * the player can change is in it: how each rotate-only piece is turned,
+ * and for each piece of the hand, the free cell it is in and how it is
+ * turned. Those are the digits of one mixed-radix number, each with a
+ * radix no larger than it needs:
+ *
+ *   the level - 1                  radix levelCount
+ *   turns of a rotate-only piece   radix its number of orientations
+ *   cell of a hand piece           radix the free cells (the hand, then
+ *                                  the blank cells of the puzzle) that
+ *                                  the hand pieces before it don't take
+ *   turns of a hand piece          radix its number of orientations
+ *
+ * The number is then written in base 26 with A for 0, least significant
+ * letter first, leaving out the A's at the end (but not all of them). A
+ * level as it is handed out is a single letter, and the code grows with
+ * what is changed.
+ */
+#define SHARE_BITS (7 + HAND_SIZE * JOURNAL_CELL_BITS + 2 * (BOARD_CELLS + HAND_SIZE)) // at most
+#define SHARE_CODE_MAX ((SHARE_BITS * 10 + 46) / 47) // a letter is worth over 4.7 bits
+#define SHARE_BYTES ((SHARE_BITS + 5 + 7) / 8) // room for any SHARE_CODE_MAX letters
+#define SHARE_LETTERS 26
+
+uint8_t shareCode[SHARE_CODE_MAX]; // 0 to 25 for A to Z
+uint8_t shareLength;
+uint8_t shareValue[SHARE_BYTES]; // the number, least significant byte first
+uint8_t sharePlace[SHARE_BYTES]; // what the next digit is worth, when encoding
+
+// number = number * radix + digit
+static void Share_MulAdd(uint8_t* number, uint8_t radix, uint8_t digit)
+{
+  uint16_t carry = digit;
+  for (uint8_t i = 0; i < SHARE_BYTES; ++i) {
+    carry += number[i] * radix;
+    number[i] = carry;
+    carry >>= 8;
+  }
+}
+
+// number = number / radix, returning the remainder
+static uint8_t Share_DivMod(uint8_t* number, uint8_t radix)
+{
+  uint16_t remainder = 0;
+  for (uint8_t i = SHARE_BYTES; i--; ) {
+    remainder = (remainder << 8) | number[i];
+    number[i] = remainder / radix;
+    remainder %= radix;
+  }
+  return remainder;
+}
+
+static bool Share_IsZero(const uint8_t* number)
+{
+  for (uint8_t i = 0; i < SHARE_BYTES; ++i)
+    if (number[i])
+      return false;
+  return true;
+}
+
+/* The next digit: when encoding, the digit is added to shareValue and
+   returned, and when decoding, it is taken off shareValue instead. */
+static uint8_t Share_Digit(bool decode, uint8_t radix, uint8_t digit)
+{
+  if (decode)
+    return Share_DivMod(shareValue, radix);
+  // shareValue += sharePlace * digit, sharePlace *= radix
+  uint16_t carry = 0;
+  for (uint8_t i = 0; i < SHARE_BYTES; ++i) {
+    carry += shareValue[i] + sharePlace[i] * digit;
+    shareValue[i] = carry;
+    carry >>= 8;
+  }
+  Share_MulAdd(sharePlace, radix, 0);
+  return digit;
+}
+
+// How many orientations a piece has, 1, 2 or 4
+static uint8_t Orientations(uint8_t piece)
+{
+  uint8_t count = 1;
+  for (uint8_t p = Rotate(piece, true); p != piece; p = Rotate(p, true))
+    ++count;
+  return count;
+}
+
+// How many quarter turns clockwise take one piece to another, or 0xFF if none do
+static uint8_t Turns(uint8_t from, uint8_t to)
+{
+  for (uint8_t turns = 0; turns < 4; ++turns, from = Rotate(from, true))
+    if (from == to)
+      return turns;
+  return 0xFF;
+}
+
+static bool FreeCell(uint8_t level, uint8_t cell)
+{
+  return (cell >= BOARD_CELLS) || (LevelByte(level, cell) == P_BLANK);
+}
+
+/* Walks the digits of a share code. When encoding, they are taken from
+   the board and the hand of the level. When decoding, the level comes
+   from the code, and the board and the hand (which LoadLevel has set up
+   for that level) are only changed if apply is set, so that a code can
+   be checked first. Returns the level, or 0 if the arrangement or the
+   code doesn't make sense. */
+static uint8_t Share_Walk(uint8_t level, bool decode, bool apply)
+{
+  level = Share_Digit(decode, levelCount, level - 1) + 1;
+
+  for (uint8_t cell = 0; cell < BOARD_CELLS; ++cell) {
+    uint8_t piece = LevelByte(level, cell);
+    if (!(PieceFlags(piece) & PF_ROTATE))
+      continue;
+    piece = DefaultDirection(piece);
+    uint8_t* p = CellPiece(cell);
+    uint8_t turns = decode ? 0 : Turns(piece, *p & 0x1F);
+    if (turns == 0xFF)
+      return 0;
+    turns = Share_Digit(decode, Orientations(piece), turns);
+    if (apply) {
+      *p = (*p & (PF_LOCK | PF_ROTATE)) | piece;
+      while (turns--)
+        *p = (*p & (PF_LOCK | PF_ROTATE)) | Rotate(*p & 0x1F, true);
+      DrawCell(cell);
+    }
+  }
+  if (apply)
+    VramQueue_Overlays();
+
+  // The pieces in the hand are only ever moved to free cells
+  uint8_t taken[(BOARD_CELLS + HAND_SIZE + 7) / 8] = {0};
+  uint8_t free = 0;
+  for (uint8_t cell = 0; cell < BOARD_CELLS + HAND_SIZE; ++cell)
+    if (FreeCell(level, cell))
+      ++free;
+  if (apply)
+    for (uint8_t cell = 0; cell < BOARD_CELLS + HAND_SIZE; ++cell)
+      if (FreeCell(level, cell) && ((*CellPiece(cell) & 0x1F) != P_BLANK)) {
+        *CellPiece(cell) = (cell < BOARD_CELLS) ? (P_BLANK | PieceFlags(P_BLANK)) : P_BLANK;
+        DrawCell(cell);
+      }
+
+  for (uint8_t i = 0; i < HAND_SIZE; ++i) {
+    uint8_t piece = LevelByte(level, 2 * BOARD_CELLS + i);
+    if (piece == P_BLANK)
+      continue;
+    piece = DefaultDirection(piece);
+
+    /* The hand comes first, so that a level as it is handed out is all
+       zeros. When encoding, the first free cell holding this kind of
+       piece is the one. */
+    uint8_t rank = decode ? Share_DivMod(shareValue, free) : 0;
+    uint8_t turns = 0xFF;
+    uint8_t cell = 0;
+    uint8_t k;
+    for (k = 0; k < BOARD_CELLS + HAND_SIZE; ++k) {
+      cell = (k < HAND_SIZE) ? BOARD_CELLS + k : k - HAND_SIZE;
+      if (!FreeCell(level, cell) || (taken[cell / 8] & (1 << (cell % 8))))
+        continue;
+      if (decode ? (rank == 0) : ((turns = Turns(piece, *CellPiece(cell) & 0x1F)) != 0xFF))
         break;
+      if (decode)
+        --rank;
+      else
+        ++rank;
+    }
+    if (k == BOARD_CELLS + HAND_SIZE)
+      return 0;
+    if (!decode)
+      Share_Digit(false, free, rank);
+    taken[cell / 8] |= 1 << (cell % 8);
+    --free;
+
+    turns = Share_Digit(decode, Orientations(piece), turns);
+    if (apply) {
+      while (turns--)
+        piece = Rotate(piece, true);
+      *CellPiece(cell) = piece;
+      DrawCell(cell);
+    }
+  }
+
+  // A code with more to it than the arrangement needs was mistyped
+  if (decode && !Share_IsZero(shareValue))
+    return 0;
+  return level;
+}
+
+// Writes the arrangement of the level into shareCode
+static bool Share_Encode(uint8_t level)
+{
+  memset(shareValue, 0, sizeof(shareValue));
+  memset(sharePlace, 0, sizeof(sharePlace));
+  sharePlace[0] = 1;
+  shareLength = 0;
+  if (!Share_Walk(level, false, false))
+    return false;
+  do
+    shareCode[shareLength++] = Share_DivMod(shareValue, SHARE_LETTERS);
+  while (!Share_IsZero(shareValue));
+  return true;
+}
+
+/* Reads shareCode, and returns its level, or 0 if it isn't a code.
+   With apply set, the arrangement is also restored, on top of that level
+   as LoadLevel leaves it. */
+static uint8_t Share_Decode(bool apply)
+{
+  memset(shareValue, 0, sizeof(shareValue));
+  for (uint8_t i = shareLength; i--; )
+    Share_MulAdd(shareValue, SHARE_LETTERS, shareCode[i]);
+  return Share_Walk(1, true, apply);
+}
+
+/*
+ * Hints
+ *
+ * Holding SELECT blinks the cell of the board where the next piece of
+ * the solution goes: the first cell, row by row, that should hold a
+ * piece it doesn't (or that holds it turned the wrong way). Failing
+ * that, it is the first cell that holds a piece it shouldn't. As the
+ * win check takes nothing but the solution in levelData, the hint is
+ * looked up there rather than searched for, so it takes a single pass
+ * over the board and no RAM beyond the blinking.
+ */
+#define HINT_NONE 0xFF
+#define HINT_HOLD_FRAMES 30 // how long SELECT is held for a hint
+#define HINT_BLINK_FRAMES 20
+#define HINT_BLINKS 3
+
+uint8_t hintCell = HINT_NONE; // the cell that is blinking
+uint8_t hintFrames;
+
+// Returns the cell to give a hint for, or HINT_NONE if the board is solved
+static uint8_t Hint_Find(uint8_t level)
+{
+  uint8_t wrong = HINT_NONE;
+  for (uint8_t cell = 0; cell < BOARD_CELLS; ++cell) {
+    uint8_t piece = LevelByte(level, BOARD_CELLS + cell);
+    if ((*CellPiece(cell) & 0x1F) == piece)
+      continue;
+    if (piece != P_BLANK)
+      return cell;
+    if (wrong == HINT_NONE)
+      wrong = cell;
+  }
+  return wrong;
+}
+
+static void Hint_Start(uint8_t level)
+{
+  hintCell = Hint_Find(level);
+  hintFrames = 0;
+  if (hintCell == HINT_NONE)
+    TriggerNote(4, 4, 11, 255); // nothing to hint at
+}
+
+/* Blinks the hint cell, from one frame to the next. The cell is put back
+   once it has blinked HINT_BLINKS times, or right away if stop is set,
+   which is whenever a button is pressed. */
+static void Hint_Update(bool stop)
+{
+  if (hintCell == HINT_NONE)
+    return;
+  uint8_t phase = hintFrames % (2 * HINT_BLINK_FRAMES);
+  if (stop || (hintFrames == HINT_BLINKS * 2 * HINT_BLINK_FRAMES) || (phase == HINT_BLINK_FRAMES)) {
+    DrawCell(hintCell);
+    if (*CellPiece(hintCell) & (PF_LOCK | PF_ROTATE))
+      VramQueue_Overlays();
+    if (stop || (hintFrames == HINT_BLINKS * 2 * HINT_BLINK_FRAMES)) {
+      hintCell = HINT_NONE;
+      return;
+    }
+  } else if (phase == 0) {
+    VramQueue_Map(CELL_TILE_X(hintCell % BOARD_WIDTH), CELL_TILE_Y(hintCell / BOARD_WIDTH), map_blank_highlight);
+  }
+  ++hintFrames;
+}
+
+// Draws the parts of the game screen that are the same for every level
+static void DrawGameScreen(void)
+{
+  for (uint8_t i = 0; i < MAX_SPRITES - 1; ++i)
+    sprites[i].x = OFF_SCREEN;
+  
+  ClearVram();
+  levelColor = TILE_BACKGROUND;
+  
+  DrawMap(1, 3, map_laser_puzzle_ii);
+  
+  DrawMap(BOARD_LEFT, HAND_TOP - 1, map_move_to_grid);
+
+  DrawMap(PREV_NEXT_X, PREV_NEXT_Y, map_prev);
+  DrawMap(PREV_NEXT_X + 2, PREV_NEXT_Y, map_next);
+
+  DrawMap(PREV_NEXT_X + 1, 9, map_level);
+
+  DrawMap(PREV_NEXT_X, 17, map_targets);
+}
+
+/* The difficulty of a level, as the color of the strip along the bottom
+   of the game screen: every 15 levels are one step harder. */
+static uint8_t LevelColor(const uint8_t level)
+{
+  uint8_t bucket = (level - 1) / 15;
+  return TILE_GREEN + ((bucket < 3) ? bucket : 3);
+}
+
+// Shows a level number with the first two digit sprites, tens at tile x
+static void DrawLevelNumber(const uint8_t level, uint8_t x, uint8_t y)
+{
+  uint8_t levelDisplay[2] = {0};
+  BCD_addConstant(levelDisplay, 2, level);
+  // Since we ran out of unique background tile indices, we have to resort to using sprites
+  sprites[0].tileIndex = levelDisplay[0] + FIRST_DIGIT_SPRITE;
+  sprites[1].tileIndex = levelDisplay[1] + FIRST_DIGIT_SPRITE;
+  
+  sprites[0].y = y * TILE_HEIGHT;
+  sprites[1].y = y * TILE_HEIGHT;
+  sprites[0].x = (x + 1) * TILE_WIDTH;
+  sprites[1].x = x * TILE_WIDTH;
+}
+
+/* Draws what belongs to the level on the game screen, with the board and
+   the hand as they are now. In the solution view, the hand is hidden. */
+static void DrawLevel(const uint8_t level, bool solution)
+{
+  // Draw a colored strip along the bottom that corresponds to the level difficulty
+  uint8_t color = LevelColor(level);
+  if (color != levelColor) {
+    for (uint8_t h = 0; h < VRAM_TILES_H; ++h)
+      SetTile(h, VRAM_TILES_V - 1, color);
+    levelColor = color;
+  }
+  
+  DrawLevelNumber(level, PREV_NEXT_X + 1, 11);
+  
+  uint8_t targets = LevelByte(level, LEVEL_SIZE - 1);
+  sprites[2].tileIndex = targets + FIRST_DIGIT_SPRITE;
+  sprites[2].x = (PREV_NEXT_X + 1) * TILE_WIDTH + (TILE_WIDTH / 2);
+  sprites[2].y = 19 * TILE_HEIGHT;
+
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+      VramQueue_Map(CELL_TILE_X(x), CELL_TILE_Y(y), MapName(board[y][x] & 0x1F));
+  /* Any pieces that are part of the inital setup can't be moved,
+     so add either a lock or rotate icon */
+  showOverlays = !solution;
+  VramQueue_Overlays();
+  
+  for (uint8_t x = 0; x < HAND_SIZE; ++x)
+    VramQueue_Map(CELL_TILE_X(x), HAND_TOP, solution ? map_blank : MapName(hand[x]));
+}
+
+/* Switches the game screen to another level. Only what differs between
+   levels is redrawn (DrawGameScreen has drawn the rest), so paging
+   through the levels doesn't flicker. */
+static void LoadLevel(const uint8_t level, bool solution)
+{
+  // The overlays of the old board must not be baked over the new one
+  VramQueue_Drain();
+  Journal_Clear();
+  Stats_Enter(level);
+  hintCell = HINT_NONE; // DrawLevel draws over it
+#if LEVEL_PACK
+  packWantNo = (level < levelCount) ? level + 1 : 1; // what NEXT would load
+#endif
+
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x) {
+      uint8_t piece = LevelByte(level, (solution ? BOARD_CELLS : 0) + y * BOARD_WIDTH + x);
+      board[y][x] = DefaultDirection(piece) | PieceFlags(piece); // set the lock or rotation bit
+    }
+  if (!solution)
+    for (uint8_t x = 0; x < HAND_SIZE; ++x)
+      hand[x] = DefaultDirection(LevelByte(level, 2 * BOARD_CELLS + x));
 
-      case P_MIRROR_TARGET_OPT_TR:
-      case P_MIRROR_TARGET_REQ_TR:
-        {
-          bool mirror_on = (((l & D_IN_T) && (l & D_OUT_R)) ||
-                            ((l & D_IN_R) && (l & D_OUT_T)));
-          bool target_on = (l & D_IN_B);
-          if (mirror_on && target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_on_tr);
-          else if (mirror_on) {
-            if ((board[y][x] & 0x1F) == P_MIRROR_TARGET_OPT_TR)
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_opt_tr);
-            else
-              DrawMap(9 + x * 4, 1 + y * 4, map_mirror_on_target_req_tr);
-          } else if (target_on)
-            DrawMap(9 + x * 4, 1 + y * 4, map_mirror_target_on_tr);
-        }
-        break;
+  DrawLevel(level, solution);
+}
 
-      case P_SPLIT_TRBL:
-        {
-          bool in_l = (l & D_IN_L) && (l & D_OUT_R) && (l & D_OUT_T);
-          bool in_t = (l & D_IN_T) && (l & D_OUT_B) && (l & D_OUT_L);
-          bool in_r = (l & D_IN_R) && (l & D_OUT_L) && (l & D_OUT_B);
-          bool in_b = (l & D_IN_B) && (l & D_OUT_T) && (l & D_OUT_R);
-          if (in_l && !in_t && !in_r && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_trbl_on_l);
-          else if (in_t && !in_l && !in_r && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_trbl_on_t);
-          else if (in_r && !in_l && !in_t && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_trbl_on_r);
-          else if (in_b && !in_l && !in_t && !in_r)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_trbl_on_b);
-          else if (in_l || in_t || in_r || in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_trbl_on_a);
-        }
-        break;
+// The photon that is being traced
+int8_t photonX;
+int8_t photonY;
+uint8_t photonD;
+/* The sides the photon has entered each cell from, 4 bits per cell
+   (the D_IN_* bits), two cells per byte */
+uint8_t photonVisited[(BOARD_CELLS + 1) / 2];
+
+/* Emits a photon from the laser piece. If it's not on the grid, then
+   the photon starts off the grid, and doesn't go anywhere. */
+static void Photon_Emit(void)
+{
+  photonX = -1;
+  photonY = -1;
+  photonD = 0;
+  memset(photonVisited, 0, sizeof(photonVisited));
 
-      case P_SPLIT_TLBR:
-        {
-          bool in_l = (l & D_IN_L) && (l & D_OUT_R) && (l & D_OUT_B);
-          bool in_t = (l & D_IN_T) && (l & D_OUT_B) && (l & D_OUT_R);
-          bool in_r = (l & D_IN_R) && (l & D_OUT_L) && (l & D_OUT_T);
-          bool in_b = (l & D_IN_B) && (l & D_OUT_T) && (l & D_OUT_L);
-          if (in_l && !in_t && !in_r && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_tlbr_on_l);
-          else if (in_t && !in_l && !in_r && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_tlbr_on_t);
-          else if (in_r && !in_l && !in_t && !in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_tlbr_on_r);
-          else if (in_b && !in_l && !in_t && !in_r)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_tlbr_on_b);
-          else if (in_l || in_t || in_r || in_b)
-            DrawMap(9 + x * 4, 1 + y * 4, map_split_tlbr_on_a);
-        }
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+      switch (board[y][x] & 0x1F) { // ignore the flag bits
+      case P_LASER_T:
+        laser[y][x] |= D_OUT_T;
+        photonX = x;
+        photonY = y - 1;
+        photonD = D_IN_B;
         break;
-
-      case P_DBL_MIRROR_TRBL:
-        {
-          bool mirror_tl = (((l & D_IN_T) && (l & D_OUT_L)) ||
-                            ((l & D_IN_L) && (l & D_OUT_T)));
-          bool mirror_br = (((l & D_IN_B) && (l & D_OUT_R)) ||
-                            ((l & D_IN_R) && (l & D_OUT_B)));
-          if (mirror_tl && mirror_br)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_trbl_on_a);
-          else if (mirror_tl)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_trbl_on_tl);
-          else if (mirror_br)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_trbl_on_br);
-        }
+      case P_LASER_R:
+        laser[y][x] |= D_OUT_R;
+        photonX = x + 1;
+        photonY = y;
+        photonD = D_IN_L;
         break;
-
-      case P_DBL_MIRROR_TLBR:
-        {
-          bool mirror_tr = (((l & D_IN_T) && (l & D_OUT_R)) ||
-                            ((l & D_IN_R) && (l & D_OUT_T)));
-          bool mirror_bl = (((l & D_IN_B) && (l & D_OUT_L)) ||
-                            ((l & D_IN_L) && (l & D_OUT_B)));
-          if (mirror_tr && mirror_bl)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_tlbr_on_a);
-          else if (mirror_tr)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_tlbr_on_tr);
-          else if (mirror_bl)
-            DrawMap(9 + x * 4, 1 + y * 4, map_dbl_mirror_tlbr_on_bl);
-        }
+      case P_LASER_B:
+        laser[y][x] |= D_OUT_B;
+        photonX = x;
+        photonY = y + 1;
+        photonD = D_IN_T;
         break;
-
-      case P_CHECKPOINT_TCBC:
-        if (((l & D_IN_L) && (l & D_OUT_R)) || ((l & D_IN_R) && (l & D_OUT_L)))
-          DrawMap(9 + x * 4, 1 + y * 4, map_checkpoint_on_tcbc);
+      case P_LASER_L:
+        laser[y][x] |= D_OUT_L;
+        photonX = x - 1;
+        photonY = y;
+        photonD = D_IN_R;
         break;
-
-      case P_CHECKPOINT_LCRC:
-        if (((l & D_IN_T) && (l & D_OUT_B)) || ((l & D_IN_B) && (l & D_OUT_T)))
-          DrawMap(9 + x * 4, 1 + y * 4, map_checkpoint_on_lcrc);
-        break;  
       }
+}
+
+// Returns 0-3 for D_IN_T, D_IN_B, D_IN_L or D_IN_R, which is the order of beamPaths
+static inline uint8_t DirectionIndex(uint8_t d)
+{
+  uint8_t i = 0;
+  for (d >>= 5; d; d >>= 1)
+    ++i;
+  return i;
+}
+
+// Swaps the top and bottom, and left and right bits of a D_OUT_* value
+static inline uint8_t Opposite(uint8_t d)
+{
+  return ((d & (D_OUT_T | D_OUT_L)) << 1) | ((d & (D_OUT_B | D_OUT_R)) >> 1);
+}
+
+/* Moves the photon one cell along its path, and returns false once it
+   has stopped. It also stops when it enters a cell from a side it has
+   entered that cell from before, so it takes at most 4 steps per cell.
+   Without splitters, that means it is caught in a loop. A splitter it
+   comes back to could send it the other way this time, but that way is
+   left to the photons that come after it. */
+static bool Photon_Step(void)
+{
+  if ((photonX < 0) || (photonX >= BOARD_WIDTH) || (photonY < 0) || (photonY >= BOARD_HEIGHT))
+    return false;
+
+  uint8_t cell = photonY * BOARD_WIDTH + photonX;
+  uint8_t state = (cell & 1) ? photonD : (photonD >> 4);
+  if (photonVisited[cell >> 1] & state) {
+    PROFILE_LOOP();
+    return false;
+  }
+  photonVisited[cell >> 1] |= state;
+
+  uint8_t path = pgm_read_byte(&beamPaths[BeamClass(board[photonY][photonX] & 0x1F)][DirectionIndex(photonD)]);
+  uint8_t out = path & (D_OUT_T | D_OUT_B | D_OUT_L | D_OUT_R);
+  if (!out) {
+    if (path & B_TARGET)
+      laser[photonY][photonX] |= photonD;
+    return false;
+  }
+  if (out & (out - 1)) {
+    // Generate a random number, and decide whether the beam passes through, or bounces
+    uint8_t straight = Opposite(photonD >> 4);
+    if (rand() > (RAND_MAX / 2))
+      out &= ~straight;
+    else
+      out = straight;
+  }
+  laser[photonY][photonX] |= photonD | out;
+
+  switch (out) {
+  case D_OUT_T:
+    photonY--;
+    break;
+  case D_OUT_B:
+    photonY++;
+    break;
+  case D_OUT_L:
+    photonX--;
+    break;
+  case D_OUT_R:
+    photonX++;
+    break;
+  }
+  photonD = Opposite(out) << 4;
+  return true;
+}
+
+/* Draws the cell at x, y with the parts of it that the laser lights up.
+   A part is lit when all the bits of one of its litParts masks are set
+   in the laser, and the first of the piece's litRules for those parts
+   gives the map. */
+static void DrawLaserCell(uint8_t x, uint8_t y)
+{
+  uint8_t l = laser[y][x];
+  uint8_t piece = board[y][x] & 0x1F; // ignore the flag bits
+  uint8_t lit = 0;
+  for (const LIT_PART* p = &litParts[pgm_read_byte(&pieceInfo[piece].parts)]; ; ++p) {
+    uint8_t mask = pgm_read_byte(&p->mask);
+    if (!mask)
+      break;
+    if ((l & mask) == mask)
+      lit |= pgm_read_byte(&p->part);
+  }
+  if (!lit)
+    return;
+
+  for (const LIT_RULE* r = &litRules[pgm_read_byte(&pieceInfo[piece].rules)]; ; ++r) {
+    uint8_t parts = pgm_read_byte(&r->parts);
+    if (!parts)
+      break;
+    if (parts == lit || parts == LIT_ANY) {
+      VramQueue_Map(CELL_TILE_X(x), CELL_TILE_Y(y), (const VRAM_PTR_TYPE*)pgm_read_ptr(&r->map));
+      break;
     }
+  }
+}
+
+// The laser as it is on screen, so only what it has lit up since gets drawn
+uint8_t laserDrawn[BOARD_HEIGHT][BOARD_WIDTH];
+
+/* Draws the cells whose laser has changed since the last call, and the
+   gaps between them that have been lit up since. Returns false if there
+   was nothing new to draw. */
+static bool DrawLaserChanges(void)
+{
+  bool changed = false;
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+      if (laser[y][x] != laserDrawn[y][x]) {
+        DrawLaserCell(x, y);
+        changed = true;
+      }
+  if (!changed)
+    return false;
 
+#if CELL_GAP
   // Fill in the gaps between squares with lasers
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 4; ++x)
-      if ((laser[y][x] & D_OUT_R) || (laser[y][x + 1] & D_OUT_L))
-        DrawMap(12 + x * 4, 2 + y * 4, map_gap_h);
-  for (uint8_t y = 0; y < 4; ++y)
-    for (uint8_t x = 0; x < 5; ++x)
-      if ((laser[y][x] & D_OUT_B) || (laser[y + 1][x] & D_OUT_T))
-        DrawMap(10 + x * 4, 4 + y * 4, map_gap_v);
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH - 1; ++x)
+      if (((laser[y][x] & D_OUT_R) || (laser[y][x + 1] & D_OUT_L)) &&
+          !((laserDrawn[y][x] & D_OUT_R) || (laserDrawn[y][x + 1] & D_OUT_L)))
+        VramQueue_Map(CELL_TILE_X(x) + PIECE_TILES, CELL_TILE_Y(y) + 1, map_gap_h);
+  for (uint8_t y = 0; y < BOARD_HEIGHT - 1; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+      if (((laser[y][x] & D_OUT_B) || (laser[y + 1][x] & D_OUT_T)) &&
+          !((laserDrawn[y][x] & D_OUT_B) || (laserDrawn[y + 1][x] & D_OUT_T)))
+        VramQueue_Map(CELL_TILE_X(x) + 1, CELL_TILE_Y(y) + PIECE_TILES, map_gap_v);
+#endif
+
+  memcpy(laserDrawn, laser, sizeof(laserDrawn));
+  VramQueue_Overlays();
+  return true;
+}
+
+/*
+ * Animated beam
+ *
+ * Rather than tracing all LASER_PHOTONS photons and then drawing the
+ * whole laser, Beam_Update traces at most BEAM_STEPS_PER_FRAME steps a
+ * frame. As soon as a step lights up something new, that is drawn, and
+ * the beam waits until BEAM_FRAMES_PER_CELL frames have passed. So the
+ * laser sweeps across the board, splitters visibly branch out, and the
+ * time spent per frame doesn't depend on how long the path is.
+ */
+#define LASER_PHOTONS 100
+#define BEAM_STEPS_PER_FRAME 64
+#define BEAM_FRAMES_PER_CELL 2
+
+uint8_t beamPhotons; // how many photons are left to emit
+bool beamInFlight; // whether a photon is being traced
+uint8_t beamWait;
+
+static void Beam_Start(void)
+{
+  /* DrawMap(7, 5, map_laser_source); */
+  memset(laser, 0, sizeof(laser));
+  memset(laserDrawn, 0, sizeof(laserDrawn));
+  PROFILE_LOOPS_RESET();
+  beamPhotons = LASER_PHOTONS;
+  beamInFlight = false;
+  beamWait = 0;
+}
+
+// Advances the beam by a frame, and returns false once all photons have been traced
+static bool Beam_Update(void)
+{
+  if (beamWait) {
+    --beamWait;
+    return true;
+  }
+
+  for (uint8_t steps = 0; steps < BEAM_STEPS_PER_FRAME; ++steps) {
+    if (beamInFlight) {
+      int8_t x = photonX;
+      int8_t y = photonY;
+      beamInFlight = Photon_Step();
+      // A step can only light up the cell the photon was in
+      if ((x < 0) || (x >= BOARD_WIDTH) || (y < 0) || (y >= BOARD_HEIGHT) || (laser[y][x] == laserDrawn[y][x]))
+        continue;
+    } else if (beamPhotons) {
+      --beamPhotons;
+      Photon_Emit();
+      beamInFlight = true;
+    } else {
+      return false;
+    }
+    if (DrawLaserChanges()) {
+      beamWait = BEAM_FRAMES_PER_CELL - 1;
+      return true;
+    }
+  }
+  return true;
 }
 
 void EraseLaser(void)
 {
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 5; ++x)
-      DrawMap(9 + x * 4, 1 + y * 4, MapName(board[y][x] & 0x1F));
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
+      VramQueue_Map(CELL_TILE_X(x), CELL_TILE_Y(y), MapName(board[y][x] & 0x1F));
       
+#if CELL_GAP
   // Erase any lasers between squares
-  for (uint8_t y = 0; y < 5; ++y)
-    for (uint8_t x = 0; x < 4; ++x)
+  for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH - 1; ++x)
       if ((laser[y][x] & D_OUT_R) || (laser[y][x + 1] & D_OUT_L))
-        SetTile(12 + x * 4, 2 + y * 4, TILE_BACKGROUND);
-  for (uint8_t y = 0; y < 4; ++y)
-    for (uint8_t x = 0; x < 5; ++x)
+        VramQueue_Tile(CELL_TILE_X(x) + PIECE_TILES, CELL_TILE_Y(y) + 1, TILE_BACKGROUND);
+  for (uint8_t y = 0; y < BOARD_HEIGHT - 1; ++y)
+    for (uint8_t x = 0; x < BOARD_WIDTH; ++x)
       if ((laser[y][x] & D_OUT_B) || (laser[y + 1][x] & D_OUT_T))
-        SetTile(10 + x * 4, 4 + y * 4, TILE_BACKGROUND);
+        VramQueue_Tile(CELL_TILE_X(x) + 1, CELL_TILE_Y(y) + PIECE_TILES, TILE_BACKGROUND);
+#endif
   /* DrawMap(7, 5, map_laser_source_off); */
-}
 
-const int8_t hitMap[] PROGMEM = {
-  0, 0, 0, -1,
-  1, 1, 1, -1,
-  2, 2, 2, -1,
-  3, 3, 3, -1,
-  4, 4, 4,
-};
+  VramQueue_Overlays();
+}
 
-const uint8_t rotateClockwise[] PROGMEM = {
-  P_BLANK, 
-  P_LASER_R, 
-  P_LASER_B,
-  P_LASER_L,
-  P_LASER_T,
-  P_LASER_U,
-  P_MIRROR_TARGET_OPT_BL,
-  P_MIRROR_TARGET_OPT_TL,
-  P_MIRROR_TARGET_OPT_TR,
-  P_MIRROR_TARGET_OPT_BR,
-  P_MIRROR_TARGET_OPT_U,
-  P_MIRROR_TARGET_REQ_BL,
-  P_MIRROR_TARGET_REQ_TL,
-  P_MIRROR_TARGET_REQ_TR,
-  P_MIRROR_TARGET_REQ_BR,
-  P_MIRROR_TARGET_REQ_U,
-  P_SPLIT_TLBR,
-  P_SPLIT_TRBL,
-  P_SPLIT_U,
-  P_DBL_MIRROR_TLBR,
-  P_DBL_MIRROR_TRBL,
-  P_DBL_MIRROR_U,
-  P_CHECKPOINT_LCRC,
-  P_CHECKPOINT_TCBC,
-  P_CHECKPOINT_U,
-  P_CELL_BLOCKER,
-};
+// Which of count cells, the first at tile first, tile t is on, or -1 if none
+static int8_t HitCell(uint8_t t, uint8_t first, uint8_t count)
+{
+  if (t < first)
+    return -1;
+  t -= first;
+  if (((t % CELL_TILES) >= PIECE_TILES) || (t / CELL_TILES >= count))
+    return -1; // the gap between two cells, or past the last one
+  return t / CELL_TILES;
+}
 
-const uint8_t rotateCounterClockwise[] PROGMEM = {
-  P_BLANK,
-  P_LASER_L,
-  P_LASER_T,
-  P_LASER_R,
-  P_LASER_B,
-  P_LASER_U,
-  P_MIRROR_TARGET_OPT_TR,
-  P_MIRROR_TARGET_OPT_BR,
-  P_MIRROR_TARGET_OPT_BL,
-  P_MIRROR_TARGET_OPT_TL,
-  P_MIRROR_TARGET_OPT_U,
-  P_MIRROR_TARGET_REQ_TR,
-  P_MIRROR_TARGET_REQ_BR,
-  P_MIRROR_TARGET_REQ_BL,
-  P_MIRROR_TARGET_REQ_TL,
-  P_MIRROR_TARGET_REQ_U,
-  P_SPLIT_TLBR,
-  P_SPLIT_TRBL,
-  P_SPLIT_U,
-  P_DBL_MIRROR_TLBR,
-  P_DBL_MIRROR_TRBL,
-  P_DBL_MIRROR_U,
-  P_CHECKPOINT_LCRC,
-  P_CHECKPOINT_TCBC,
-  P_CHECKPOINT_U,
-  P_CELL_BLOCKER,
-};
+/* Finds the cell that the cursor is on. y is HAND_ROW for the hand, and
+   x and y are both -1 when the cursor isn't on any cell. */
+static void HitTest(int8_t* x, int8_t* y)
+{
+  uint8_t tx = sprites[MAX_SPRITES - 1].x / TILE_WIDTH;
+  uint8_t ty = sprites[MAX_SPRITES - 1].y / TILE_HEIGHT;
+  *y = HitCell(ty, BOARD_TOP, BOARD_HEIGHT);
+  *x = HitCell(tx, BOARD_LEFT, BOARD_WIDTH);
+  if (*y < 0) {
+    *y = (HitCell(ty, HAND_TOP, 1) == 0) ? HAND_ROW : -1;
+    *x = HitCell(tx, BOARD_LEFT, HAND_SIZE);
+  }
+  if ((*x < 0) || (*y < 0))
+    *x = *y = -1;
+}
 
 int8_t old_piece = -1;
 int8_t old_x = -1;
-int8_t old_y = -1; // if this is 5, then it refers to hand
+int8_t old_y = -1; // if this is HAND_ROW, then it refers to hand
+int8_t highlight_x = -1;
+int8_t highlight_y = -1; // if this is HAND_ROW, then it refers to hand
+uint8_t dragFrom; // the cell number the held piece came from
+uint8_t dragTurns; // quarter turns clockwise the held piece has been rotated
+
+/* Moves the highlight to the blank square at x, y (or to none, if x is
+   -1). Only a change is queued, rather than redrawing every blank
+   square each frame. */
+static void SetHighlight(int8_t x, int8_t y)
+{
+  if ((x == highlight_x) && (y == highlight_y))
+    return;
+  if (highlight_x >= 0)
+    VramQueue_Map(CELL_TILE_X(highlight_x), (highlight_y == HAND_ROW) ? HAND_TOP : CELL_TILE_Y(highlight_y), map_blank);
+  if (x >= 0)
+    VramQueue_Map(CELL_TILE_X(x), (y == HAND_ROW) ? HAND_TOP : CELL_TILE_Y(y), map_blank_highlight);
+  highlight_x = x;
+  highlight_y = y;
+}
+
+/* Moves the piece being dragged along with the cursor. Unless it is
+   aligned to the tile grid, the 3x3 block of sprites covers 16 RAM tiles
+   (the cursor always lies within them). When the overlays and the other
+   sprites leave fewer than that, the piece snaps to the grid, first
+   horizontally (12 RAM tiles) and then vertically as well (9), so the
+   kernel never runs out of RAM tiles and drops parts of it. */
+static void MoveDragSprites(void)
+{
+  uint8_t x = sprites[MAX_SPRITES - 1].x - 8;
+  uint8_t y = sprites[MAX_SPRITES - 1].y - 8;
+  uint8_t available = RAM_TILES_COUNT - overlayCount - DIGIT_RAM_TILES - DEBUG_SPRITES;
+  if (available < 16) {
+    x &= ~(TILE_WIDTH - 1);
+    if (available < 12)
+      y &= ~(TILE_HEIGHT - 1);
+  }
+  MoveSprite(MAX_SPRITES - 10, x, y, 3, 3);
+}
 
-void TryRotation(const uint8_t* rotation_lut)
+void TryRotation(bool clockwise)
 {
   if (old_piece == -1) { // nothing being dragged and dropped
-    uint8_t tx = sprites[MAX_SPRITES - 1].x / TILE_WIDTH;
-    uint8_t ty = sprites[MAX_SPRITES - 1].y / TILE_HEIGHT;
-    if ((ty >= 1) && (ty <= 19) && (tx >= 9) && (tx <= 27)) { // from grid
-      int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-      int8_t y = pgm_read_byte(&hitMap[ty - 1]);
-      if ((x >= 0) && (y >= 0) && !(board[y][x] & 0x80)) { // respect lock bit
+    int8_t x, y;
+    HitTest(&x, &y);
+    if ((y >= 0) && (y < HAND_ROW)) { // from grid
+      if (!(board[y][x] & PF_LOCK)) {
         // Save the rotate bit, if set
-        uint8_t flags = board[y][x] & 0xE0;
-        board[y][x] = flags | pgm_read_byte(&rotation_lut[board[y][x] & 0x1F]);
-        DrawMap(9 + x * 4, 1 + y * 4, MapName(board[y][x] & 0x1F));
+        uint8_t flags = board[y][x] & PF_ROTATE;
+        board[y][x] = flags | Rotate(board[y][x] & 0x1F, clockwise);
+        VramQueue_Map(CELL_TILE_X(x), CELL_TILE_Y(y), MapName(board[y][x] & 0x1F));
+        VramQueue_Overlays();
+        if ((board[y][x] & 0x1F) != P_BLANK) {
+          Journal_Record(CellNo(x, y), CellNo(x, y), clockwise ? 1 : 3);
+          Stats_Count(STATS_ROTATIONS);
+        }
         TriggerNote(4, 3, 23, 255);
       }
-    } else if ((ty >= 23) && (ty <= 25) && (tx >= 9) && (tx <= 27)) {
-      int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-      if (x >= 0) {
-        hand[x] = pgm_read_byte(&rotation_lut[hand[x]]);
-        DrawMap(9 + x * 4, 23, MapName(hand[x]));
-        TriggerNote(4, 3, 23, 255);
+    } else if (y == HAND_ROW) {
+      hand[x] = Rotate(hand[x], clockwise);
+      VramQueue_Map(CELL_TILE_X(x), HAND_TOP, MapName(hand[x]));
+      if (hand[x] != P_BLANK) {
+        Journal_Record(CellNo(x, y), CellNo(x, y), clockwise ? 1 : 3);
+        Stats_Count(STATS_ROTATIONS);
       }
+      TriggerNote(4, 3, 23, 255);
     }
   } else {
-    old_piece = pgm_read_byte(&rotation_lut[old_piece]);
+    old_piece = Rotate(old_piece, clockwise);
+    dragTurns += clockwise ? 1 : 3;
+    Stats_Count(STATS_ROTATIONS);
     MapSprite2(MAX_SPRITES - 10, MapName(old_piece), SPRITE_BANK1);
-    MoveSprite(MAX_SPRITES - 10, sprites[MAX_SPRITES - 1].x - 8, sprites[MAX_SPRITES - 1].y - 8, 3, 3);
+    MoveDragSprites();
     TriggerNote(4, 3, 23, 255);
   }
 }
@@ -2177,65 +3201,461 @@ const uint8_t myramfont[] PROGMEM = {
   0x00, 0x00, 0x00, 0x3e, 0x00, 0x00, 0x00, 0x00, 
 };
 
-void RamFont_Load(const uint8_t* ramfont, uint8_t len, uint8_t fg_color, uint8_t bg_color)
+// What is currently expanded into the user RAM tiles
+const uint8_t* ramFontLoaded;
+uint8_t ramFontLen;
+uint8_t ramFontFg;
+uint8_t ramFontBg;
+
+/* Changes the foreground color of tiles that are already expanded, by
+   using the font itself as a mask. Only the foreground pixels are
+   written, and empty glyph rows are skipped entirely. */
+static void RamFont_Recolor(const uint8_t* glyphs, uint8_t len, uint8_t fg_color)
+{
+  uint8_t* ramTile = GetUserRamTile(0);
+  for (uint8_t i = 0; i < len; ++i) {
+    const uint8_t* glyph = &myramfont[pgm_read_byte(&glyphs[i]) * 8];
+    for (uint8_t rows = 8; rows; --rows) {
+      uint8_t data = (uint8_t)pgm_read_byte(glyph++);
+      if (data) {
+        if (data & 0x01) ramTile[0] = fg_color;
+        if (data & 0x02) ramTile[1] = fg_color;
+        if (data & 0x04) ramTile[2] = fg_color;
+        if (data & 0x08) ramTile[3] = fg_color;
+        if (data & 0x10) ramTile[4] = fg_color;
+        if (data & 0x20) ramTile[5] = fg_color;
+        if (data & 0x40) ramTile[6] = fg_color;
+        if (data & 0x80) ramTile[7] = fg_color;
+      }
+      ramTile += 8;
+    }
+  }
+}
+
+/* Expands glyphs of the 1bpp font into user RAM tiles. Each screen
+   passes the list of glyphs its text uses (see data/text.txt), so RAM
+   tiles past the end of that list stay free for the sprites.
+
+   Each glyph row is expanded with unrolled code rather than a loop
+   over the bits, because the AVR can only shift by a variable amount
+   one bit at a time. Tiles that already hold the requested glyph and
+   colors are not written again, and if only the foreground color
+   changed (like during the intro fade), just the foreground pixels
+   are rewritten. */
+void RamFont_Load(const uint8_t* glyphs, uint8_t len, uint8_t fg_color, uint8_t bg_color)
 {
   SetUserRamTilesCount(len);
-  for (uint8_t tile = 0; tile < len; ++tile) {
-    uint8_t* ramTile = GetUserRamTile(tile);
-    for (uint8_t row = 0; row < 8; ++row) {
-      uint8_t data = (uint8_t)pgm_read_byte(&ramfont[tile * 8 + row]);
-      for (uint8_t bit = 0; bit < 8; ++bit)
-        if (data & (1 << bit))
-          ramTile[row * 8 + bit] = fg_color;
-        else
-          ramTile[row * 8 + bit] = bg_color;
+
+  if ((glyphs == ramFontLoaded) && (bg_color == ramFontBg) && (fg_color != ramFontFg)
+      && (len <= ramFontLen)) {
+    RamFont_Recolor(glyphs, len, fg_color);
+    ramFontLen = len;
+    ramFontFg = fg_color;
+    return;
+  }
+
+  uint8_t first = 0;
+  if ((glyphs == ramFontLoaded) && (fg_color == ramFontFg) && (bg_color == ramFontBg))
+    first = ramFontLen;
+  if (first >= len) {
+    ramFontLen = len; // tiles past len now belong to the sprites
+    return;
+  }
+
+  uint8_t* ramTile = GetUserRamTile(first);
+  for (uint8_t i = first; i < len; ++i) {
+    const uint8_t* glyph = &myramfont[pgm_read_byte(&glyphs[i]) * 8];
+    for (uint8_t rows = 8; rows; --rows) {
+      uint8_t data = (uint8_t)pgm_read_byte(glyph++);
+      ramTile[0] = (data & 0x01) ? fg_color : bg_color;
+      ramTile[1] = (data & 0x02) ? fg_color : bg_color;
+      ramTile[2] = (data & 0x04) ? fg_color : bg_color;
+      ramTile[3] = (data & 0x08) ? fg_color : bg_color;
+      ramTile[4] = (data & 0x10) ? fg_color : bg_color;
+      ramTile[5] = (data & 0x20) ? fg_color : bg_color;
+      ramTile[6] = (data & 0x40) ? fg_color : bg_color;
+      ramTile[7] = (data & 0x80) ? fg_color : bg_color;
+      ramTile += 8;
     }
   }
+
+  ramFontLoaded = glyphs;
+  ramFontLen = len;
+  ramFontFg = fg_color;
+  ramFontBg = bg_color;
 }
 
-const char pgm_inventor[] PROGMEM = "INVENTOR  LUKE HOOPER";
-const char pgm_puzzles1[] PROGMEM = "PUZZLES  WEI\\HUANG[";
-const char pgm_puzzles2[] PROGMEM = "TYLER SOMER[";
-const char pgm_puzzles3[] PROGMEM = "LUKE HOOPER[";
-const char pgm_puzzles4[] PROGMEM = "TANYA THOMPSON";
-const char pgm_tada[] PROGMEM     = "TADA SOUND  MIKE KOENIG";
-const char pgm_uzebox[] PROGMEM   = "UZEBOX GAME  MATT PANDINA";
-const char pgm_play[] PROGMEM     = "PLAY";
-const char pgm_controls[] PROGMEM = "CONTROLS";
-const char pgm_tokens[] PROGMEM   = "TOKENS";
-
-const char pgm_instructions1[] PROGMEM = "THE LASER MUST TOUCH EVERY";
-const char pgm_instructions2[] PROGMEM = "TOKEN AT LEAST ONCE";
-const char pgm_instructions3[] PROGMEM = "EXCLUDING THE CELL BLOCKER";
-
-const char pgm_instructions4[] PROGMEM = "D\\PAD  MOVE CURSOR";
-const char pgm_instructions5[] PROGMEM = "A  CLICK[ DRAG\\AND\\DROP";
-const char pgm_instructions6[] PROGMEM = "Y  ACTIVATE LASER";
-const char pgm_instructions7[] PROGMEM = "L[ B  ROTATE TOKEN LEFT";
-const char pgm_instructions8[] PROGMEM = "R[ X  ROTATE TOKEN RIGHT";
-const char pgm_instructions9[] PROGMEM = "SELECT  TOGGLE MUSIC";
-
-const char pgm_laser[] PROGMEM         = "LASER";
-const char pgm_target[] PROGMEM        = "TARGET";
-const char pgm_comma[] PROGMEM         = "[";
-const char pgm_mirror[] PROGMEM        = "MIRROR";
-const char pgm_beam_splitter[] PROGMEM = "BEAM SPLITTER";
-const char pgm_double_mirror[] PROGMEM = "DOUBLE MIRROR";
-const char pgm_checkpoint[] PROGMEM    = "CHECKPOINT";
-const char pgm_cell_blocker[] PROGMEM  = "CELL BLOCKER";
-const char pgm_must[] PROGMEM          = "MUST";
-const char pgm_can[] PROGMEM           = "CAN";
-const char pgm_be_used_as_a[] PROGMEM  = "BE USED AS A";
-const char pgm_press_a1[] PROGMEM      = "PRESS A TO CONTINUE";
-const char pgm_this_does_not[] PROGMEM = "THIS DOES NOT BLOCK LASER";
-
-void RamFont_Print(uint8_t x, uint8_t y, const char *message, uint8_t len)
+// Gives the RAM tiles back to the sprites, which will overwrite them
+void RamFont_Unload(void)
 {
-  for (uint8_t i = 0; i < len; ++i) {
-    int8_t tileno = (int8_t)pgm_read_byte(&message[i]) - 'A';
-    if (tileno >= 0)
-      SetRamTile(x + i, y, tileno);
+  SetUserRamTilesCount(0);
+  ramFontLoaded = 0;
+  ramFontLen = 0;
+}
+
+/* Strings come from data/text.inc, already encoded as runs of RAM tile
+   indices for the glyphs of their screen, so each run is copied straight
+   into VRAM. */
+void RamFont_Print(uint8_t x, uint8_t y, const uint8_t* message, uint8_t len)
+{
+  uint8_t* dst = &vram[y * VRAM_TILES_H + x];
+  const uint8_t* end = message + len;
+  while (message != end) {
+    dst += pgm_read_byte(message++);
+    uint8_t count = pgm_read_byte(message++);
+    memcpy_P(dst, message, count);
+    dst += count;
+    message += count;
+  }
+}
+
+// Row and first and last column of the text of each title screen menu item
+const uint8_t titleBars[3][3] PROGMEM = {
+  { 15, 12, 17 }, // PLAY
+  { 17, 10, 19 }, // CONTROLS
+  { 19, 11, 18 }, // TOKENS
+};
+
+// Draws or erases the laser bar on both sides of a title screen menu item
+static void TitleBar(uint8_t selection, uint8_t tile)
+{
+  uint8_t y = pgm_read_byte(&titleBars[selection][0]);
+  uint8_t left = pgm_read_byte(&titleBars[selection][1]);
+  uint8_t right = pgm_read_byte(&titleBars[selection][2]);
+  for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
+    if (i < left || i > right)
+      SetTile(i, y, tile);
+}
+
+// Draws one page of the tokens screen, which stays put until A is pressed
+static void DrawTokensPage(uint8_t piece)
+{
+  ClearVram();
+  RamFont_Print(10, 26, pgm_press_a1, sizeof(pgm_press_a1));
+
+  switch (piece) {
+  case 0:
+    RamFont_Print(2, 2, pgm_laser, sizeof(pgm_laser));
+    DrawMap(13, 12, map_laser_b);
+    break;
+  case 1:
+    RamFont_Print(2, 2, pgm_target, sizeof(pgm_target));
+    RamFont_Print(8, 2, pgm_comma, sizeof(pgm_comma));
+    RamFont_Print(10, 2, pgm_mirror, sizeof(pgm_mirror));
+    DrawMap(13, 12, map_mirror_target_req_tr);
+    RamFont_Print(2, 20, pgm_must, sizeof(pgm_must));
+    RamFont_Print(7, 20, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
+    RamFont_Print(20, 20, pgm_target, sizeof(pgm_target));
+    RamFont_Print(26, 20, pgm_comma, sizeof(pgm_comma));
+    RamFont_Print(2, 22, pgm_can, sizeof(pgm_can));
+    RamFont_Print(6, 22, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
+    RamFont_Print(19, 22, pgm_mirror, sizeof(pgm_mirror));
+    break;
+  case 2:
+    RamFont_Print(2, 2, pgm_target, sizeof(pgm_target));
+    RamFont_Print(8, 2, pgm_comma, sizeof(pgm_comma));
+    RamFont_Print(10, 2, pgm_mirror, sizeof(pgm_mirror));
+    DrawMap(13, 12, map_mirror_target_opt_tr);
+    RamFont_Print(2, 20, pgm_can, sizeof(pgm_can));
+    RamFont_Print(6, 20, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
+    RamFont_Print(19, 20, pgm_target, sizeof(pgm_target));
+    RamFont_Print(25, 20, pgm_comma, sizeof(pgm_comma));
+    RamFont_Print(2, 22, pgm_can, sizeof(pgm_can));
+    RamFont_Print(6, 22, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
+    RamFont_Print(19, 22, pgm_mirror, sizeof(pgm_mirror));
+    break;
+  case 3:
+    RamFont_Print(2, 2, pgm_beam_splitter, sizeof(pgm_beam_splitter));
+    DrawMap(13, 12, map_split_tlbr);
+    break;
+  case 4:
+    RamFont_Print(2, 2, pgm_double_mirror, sizeof(pgm_double_mirror));
+    DrawMap(13, 12, map_dbl_mirror_tlbr);
+    break;
+  case 5:
+    RamFont_Print(2, 2, pgm_checkpoint, sizeof(pgm_checkpoint));
+    DrawMap(13, 12, map_checkpoint_tcbc);
+    break;
+  case 6:
+    RamFont_Print(2, 2, pgm_cell_blocker, sizeof(pgm_cell_blocker));
+    DrawMap(13, 12, map_cell_blocker);
+    RamFont_Print(2, 20, pgm_this_does_not, sizeof(pgm_this_does_not));
+    break;
+  }
+}
+
+/*
+ * Progress
+ *
+ * Which levels have been solved is kept in an EEPROM block, one bit per
+ * level, so the level select screen can mark them. The block is only
+ * written when a level is solved for the first time. A level pack gets
+ * a block of its own, as its level numbers are other levels.
+ */
+#define PROGRESS_EEPROM_ID 0x4C50
+#define PROGRESS_PACK_EEPROM_ID 0x4C51
+
+struct EepromBlockStruct progress;
+
+static void Progress_Load(void)
+{
+  uint16_t id = PROGRESS_EEPROM_ID;
+#if LEVEL_PACK
+  if (packOpen)
+    id = PROGRESS_PACK_EEPROM_ID;
+#endif
+  if (EEPROM_ReadBlock(id, &progress) != 0) {
+    memset(&progress, 0, sizeof(progress));
+    progress.id = id;
+  }
+}
+
+static bool Progress_Solved(const uint8_t level)
+{
+  return progress.data[(level - 1) / 8] & (1 << ((level - 1) % 8));
+}
+
+static void Progress_SetSolved(const uint8_t level)
+{
+  if (Progress_Solved(level))
+    return;
+  progress.data[(level - 1) / 8] |= 1 << ((level - 1) % 8);
+  EEPROM_WriteBlock(&progress);
+}
+
+/*
+ * Share code screen
+ *
+ * Shows the share code of the arrangement on the board, which can then
+ * be changed letter by letter into another one. The screen loads every
+ * letter (see data/text.txt), so that VRAM gets a letter's value as its
+ * RAM tile. That takes all but one of the RAM tiles, so there are no
+ * sprites on this screen. A code that is too long for one row (on big
+ * boards) goes on two, each with the cursor row under it.
+ */
+#define SHARE_ROWS ((SHARE_CODE_MAX + VRAM_TILES_H - 3) / (VRAM_TILES_H - 2))
+#define SHARE_ROW_LETTERS ((SHARE_CODE_MAX + SHARE_ROWS - 1) / SHARE_ROWS)
+#define SHARE_LEFT ((VRAM_TILES_H - SHARE_ROW_LETTERS) / 2)
+#define SHARE_TOP 12
+#define SHARE_X(i) (SHARE_LEFT + (i) % SHARE_ROW_LETTERS)
+#define SHARE_Y(i) (SHARE_TOP + ((i) / SHARE_ROW_LETTERS) * 2)
+
+bool shareRestore; // whether a share code was entered on the level select screen
+
+static void DrawShareLetter(uint8_t i)
+{
+  if (i < shareLength)
+    vram[SHARE_Y(i) * VRAM_TILES_H + SHARE_X(i)] = shareCode[i];
+  else
+    SetTile(SHARE_X(i), SHARE_Y(i), TILE_BACKGROUND);
+}
+
+// Draws the screen with the share code of the level's arrangement
+static void DrawShareScreen(const uint8_t level)
+{
+  for (uint8_t i = 0; i < MAX_SPRITES; ++i)
+    sprites[i].x = OFF_SCREEN;
+
+  ClearVram();
+  RamFont_Load(ramfont_share, sizeof(ramfont_share), 0x00, 0xad);
+  RamFont_Print(10, 2, pgm_share_code, sizeof(pgm_share_code));
+  RamFont_Print(10, 22, pgm_restore, sizeof(pgm_restore));
+  RamFont_Print(10, 24, pgm_back, sizeof(pgm_back));
+
+  if (!Share_Encode(level))
+    shareLength = 0;
+  for (uint8_t i = 0; i < shareLength; ++i)
+    DrawShareLetter(i);
+  RamFont_Print(SHARE_X(0), SHARE_Y(0) + 1, pgm_cursor, sizeof(pgm_cursor));
+}
+
+/* Lets the player read and type a share code. Returns the level of the
+   code once A is pressed on one that makes sense, or 0 for B. */
+static uint8_t ShareScreen(const uint8_t level, BUTTON_INFO* buttons)
+{
+  DrawShareScreen(level);
+  uint8_t cursor = 0;
+
+  for (;;) {
+    WaitVsync(1);
+
+    // Read the current state of the player's controller
+    buttons->prev = buttons->held;
+    buttons->held = ReadInput();
+    buttons->pressed = buttons->held & (buttons->held ^ buttons->prev);
+    buttons->released = buttons->prev & (buttons->held ^ buttons->prev);
+
+    uint8_t prevCursor = cursor;
+    if ((buttons->pressed & BTN_RIGHT) && (cursor < SHARE_CODE_MAX - 1))
+      ++cursor;
+    else if ((buttons->pressed & BTN_LEFT) && (cursor > 0))
+      --cursor;
+    if (cursor != prevCursor) {
+      SetTile(SHARE_X(prevCursor), SHARE_Y(prevCursor) + 1, TILE_BACKGROUND);
+      RamFont_Print(SHARE_X(cursor), SHARE_Y(cursor) + 1, pgm_cursor, sizeof(pgm_cursor));
+    }
+
+    if (buttons->pressed & (BTN_UP | BTN_DOWN)) {
+      // Past the end of the code, the letters are all A's
+      while (shareLength <= cursor) {
+        shareCode[shareLength] = 0;
+        DrawShareLetter(shareLength++);
+      }
+      if (buttons->pressed & BTN_UP)
+        shareCode[cursor] = (shareCode[cursor] + 1) % SHARE_LETTERS;
+      else
+        shareCode[cursor] = (shareCode[cursor] + SHARE_LETTERS - 1) % SHARE_LETTERS;
+      DrawShareLetter(cursor);
+      TriggerNote(4, 3, 23, 255);
+    }
+
+    if (buttons->pressed & BTN_A) {
+      uint8_t codeLevel = Share_Decode(false);
+      if (codeLevel) {
+        TriggerNote(4, 4, 23, 255);
+        return codeLevel;
+      }
+      TriggerNote(4, 4, 11, 255); // not a code
+    }
+    if (buttons->pressed & BTN_B) {
+      TriggerNote(4, 4, 23, 255);
+      return 0;
+    }
+  }
+}
+
+/*
+ * Level select screen
+ *
+ * Every level is one tile of its difficulty color, in rows of
+ * SELECT_COLUMNS. Solved levels get a dot, and the selected one a
+ * frame. Those are RAM tiles that are composited once, when the screen
+ * is drawn, behind the glyphs of its title, so moving the selection
+ * only writes the two tiles that change in VRAM.
+ */
+#define SELECT_COLUMNS 10
+#define SELECT_LEFT 5
+#define SELECT_TOP 6
+#define SELECT_COLORS 4 // TILE_GREEN to TILE_RED
+#define SELECT_VARIANTS 3 // solved, selected, or both
+#define SELECT_RAM_TILES (SELECT_COLORS * SELECT_VARIANTS)
+#define SELECT_MARK 0x00
+#define SELECT_FRAME 0xFF
+#define SELECT_MAX_LEVELS 99 // as many as two digits can number
+
+#if ((SELECT_MAX_LEVELS + SELECT_COLUMNS - 1) / SELECT_COLUMNS) * 2 + SELECT_TOP > VRAM_TILES_V
+#error "The level select grid doesn't fit on the screen"
+#endif
+
+// Where the level's tile is in VRAM
+static uint8_t* SelectCell(const uint8_t level)
+{
+  uint8_t row = (level - 1) / SELECT_COLUMNS;
+  uint8_t column = (level - 1) % SELECT_COLUMNS;
+  return &vram[(SELECT_TOP + row * 2) * VRAM_TILES_H + SELECT_LEFT + column * 2];
+}
+
+// The VRAM tile for a level, a flash tile unless it needs a mark
+static uint8_t SelectTile(const uint8_t level, bool selected)
+{
+  uint8_t color = LevelColor(level);
+  uint8_t variant = (Progress_Solved(level) ? 1 : 0) | (selected ? 2 : 0);
+  if (!variant)
+    return color + RAM_TILES_COUNT;
+  return sizeof(ramfont_select) + (color - TILE_GREEN) * SELECT_VARIANTS + variant - 1;
+}
+
+static void DrawSelectScreen(const uint8_t selected)
+{
+  for (uint8_t i = 0; i < MAX_SPRITES; ++i)
+    sprites[i].x = OFF_SCREEN;
+
+  ClearVram();
+  levelColor = TILE_BACKGROUND;
+  RamFont_Load(ramfont_select, sizeof(ramfont_select), 0x00, 0xad);
+  RamFont_Print(9, 2, pgm_select_level, sizeof(pgm_select_level));
+  RamFont_Print(6, 26, pgm_select_share, sizeof(pgm_select_share));
+
+  SetUserRamTilesCount(sizeof(ramfont_select) + SELECT_RAM_TILES);
+  uint8_t* ramTile = GetUserRamTile(sizeof(ramfont_select));
+  for (uint8_t color = TILE_GREEN; color < TILE_GREEN + SELECT_COLORS; ++color)
+    for (uint8_t variant = 1; variant <= SELECT_VARIANTS; ++variant) {
+      const char* tile = &tileset[color * TILE_WIDTH * TILE_HEIGHT];
+      for (uint8_t y = 0; y < TILE_HEIGHT; ++y)
+        for (uint8_t x = 0; x < TILE_WIDTH; ++x) {
+          uint8_t px = (uint8_t)pgm_read_byte(tile++);
+          if ((variant & 1) && (x >= 2) && (x <= 5) && (y >= 2) && (y <= 5))
+            px = SELECT_MARK;
+          if ((variant & 2) && ((x == 0) || (x == TILE_WIDTH - 1) || (y == 0) || (y == TILE_HEIGHT - 1)))
+            px = SELECT_FRAME;
+          *ramTile++ = px;
+        }
+    }
+
+  for (uint8_t level = 1; level <= levelCount; ++level)
+    *SelectCell(level) = SelectTile(level, level == selected);
+  DrawLevelNumber(selected, 22, 2);
+}
+
+/* Lets the player pick a level, starting with the one being played, or
+   enter a share code with SELECT (which sets shareRestore). Returns the
+   level to load, or 0 if B was pressed to keep playing. The caller
+   redraws the game screen afterwards. */
+static uint8_t LevelSelect(const uint8_t current, BUTTON_INFO* buttons)
+{
+  VramQueue_Drain();
+  uint8_t cursorX = sprites[MAX_SPRITES - 1].x;
+  DrawSelectScreen(current);
+  shareRestore = false;
+
+  uint8_t selected = current;
+  for (;;) {
+    WaitVsync(1);
+
+    // Read the current state of the player's controller
+    buttons->prev = buttons->held;
+    buttons->held = ReadInput();
+    buttons->pressed = buttons->held & (buttons->held ^ buttons->prev);
+    buttons->released = buttons->prev & (buttons->held ^ buttons->prev);
+
+    uint8_t prevSelected = selected;
+    if ((buttons->pressed & BTN_RIGHT) && (selected < levelCount))
+      ++selected;
+    else if ((buttons->pressed & BTN_LEFT) && (selected > 1))
+      --selected;
+    else if ((buttons->pressed & BTN_DOWN) && (selected + SELECT_COLUMNS <= levelCount))
+      selected += SELECT_COLUMNS;
+    else if ((buttons->pressed & BTN_UP) && (selected > SELECT_COLUMNS))
+      selected -= SELECT_COLUMNS;
+    if (selected != prevSelected) {
+      TriggerNote(4, 3, 23, 255);
+      *SelectCell(prevSelected) = SelectTile(prevSelected, false);
+      *SelectCell(selected) = SelectTile(selected, true);
+      DrawLevelNumber(selected, 22, 2);
+    }
+
+    if ((buttons->pressed & BTN_A) || (buttons->pressed & BTN_START) || (buttons->pressed & BTN_B)) {
+      TriggerNote(4, 4, 23, 255);
+      if (buttons->pressed & BTN_B)
+        selected = 0;
+      break;
+    }
+
+    if (buttons->pressed & BTN_SELECT) {
+      TriggerNote(4, 3, 23, 255);
+      uint8_t level = ShareScreen(current, buttons);
+      if (level) {
+        shareRestore = true;
+        selected = level;
+        break;
+      }
+      DrawSelectScreen(selected);
+    }
   }
+
+  RamFont_Unload();
+  sprites[MAX_SPRITES - 1].x = cursorX;
+  return selected;
 }
 
 int main()
@@ -2243,10 +3663,14 @@ int main()
   BUTTON_INFO buttons;
   memset(&buttons, 0, sizeof(BUTTON_INFO));
   InitMusicPlayer(patches);
+  DEBUG_INIT();
+  INPUT_INIT();
+  SetUserPostVsyncCallback(&VramQueue_Vsync);
 
   /* INTRO AND TITLE SCREEN */ {
+    STACKMON_ENTER(STACKMON_TITLE);
     ClearVram();  
-    RamFont_Load(myramfont, sizeof(myramfont) / 8, 0x00, 0x00);
+    RamFont_Load(ramfont_intro, sizeof(ramfont_intro), 0x00, 0x00);
     RamFont_Print(5, 5, pgm_inventor, sizeof(pgm_inventor));
     RamFont_Print(6, 9, pgm_puzzles1, sizeof(pgm_puzzles1));
     RamFont_Print(15, 11, pgm_puzzles2, sizeof(pgm_puzzles2));
@@ -2254,12 +3678,16 @@ int main()
     RamFont_Print(15, 15, pgm_puzzles4, sizeof(pgm_puzzles4));
     RamFont_Print(3, 19, pgm_tada, sizeof(pgm_tada));
     RamFont_Print(2, 23, pgm_uzebox, sizeof(pgm_uzebox));
+#if RECORD
+    if (!replaySize)
+      RamFont_Print(1, 26, pgm_no_record, sizeof(pgm_no_record));
+#endif
   
     uint8_t col = 0;
     for (;;) {
       WaitVsync(5);
       ++col;
-      RamFont_Load(myramfont, sizeof(myramfont) / 8, col, 0x00);
+      RamFont_Load(ramfont_intro, sizeof(ramfont_intro), col, 0x00);
       if (col == 7) {
         WaitVsync(235);
         break;
@@ -2268,7 +3696,7 @@ int main()
     for (;;) {
       WaitVsync(5);
       --col;
-      RamFont_Load(myramfont, sizeof(myramfont) / 8, col, 0x00);
+      RamFont_Load(ramfont_intro, sizeof(ramfont_intro), col, 0x00);
       if (col == 0) {
         WaitVsync(60);
         break;
@@ -2276,69 +3704,27 @@ int main()
     }
 
   title_screen:
+    STACKMON_ENTER(STACKMON_TITLE);
     ClearVram();
     SetTileTable(titlescreen);
-    RamFont_Load(myramfont, sizeof(myramfont) / 8, 0x00, 0xad);
+    RamFont_Load(ramfont_title, sizeof(ramfont_title), 0x00, 0xad);
     DrawMap(6, 7, map_title_big);
     RamFont_Print(13, 15, pgm_play, sizeof(pgm_play));
     RamFont_Print(11, 17, pgm_controls, sizeof(pgm_controls));
     RamFont_Print(12, 19, pgm_tokens, sizeof(pgm_tokens));
 
     uint8_t selection = 0;
+    TitleBar(selection, TILE_TITLE_LASER);
     for (;;) {
       WaitVsync(1);
       
-      switch (selection) {
-      case 0:
-        // Erase laser bar for CONTROLS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 10 || i > 19)
-            SetTile(i, 17, TILE_BACKGROUND);
-        // Erase laser bar for TOKENS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 11 || i > 18)
-            SetTile(i, 19, TILE_BACKGROUND);      
-        // Draw laser bar for PLAY
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 12 || i > 17)
-            SetTile(i, 15, TILE_TITLE_LASER);
-        break;
-      case 1:
-        // Erase laser bar for PLAY
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 12 || i > 17)
-            SetTile(i, 15, TILE_BACKGROUND);
-        // Erase laser bar for TOKENS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 11 || i > 18)
-            SetTile(i, 19, TILE_BACKGROUND);      
-        // Draw laser bar for CONTROLS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 10 || i > 19)
-            SetTile(i, 17, TILE_TITLE_LASER);
-        break;
-      case 2:
-        // Erase laser bar for PLAY
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 12 || i > 17)
-            SetTile(i, 15, TILE_BACKGROUND);
-        // Erase laser bar for CONTROLS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 10 || i > 19)
-            SetTile(i, 17, TILE_BACKGROUND);
-        // Draw laser bar for TOKENS
-        for (uint8_t i = 0; i < SCREEN_TILES_H; ++i)
-          if (i < 11 || i > 18)
-            SetTile(i, 19, TILE_TITLE_LASER);     
-        break;
-      }
-        
       // Read the current state of the player's controller
       buttons.prev = buttons.held;
-      buttons.held = ReadJoypad(0);
+      buttons.held = ReadInput();
       buttons.pressed = buttons.held & (buttons.held ^ buttons.prev);
       buttons.released = buttons.prev & (buttons.held ^ buttons.prev);
 
+      uint8_t prevSelection = selection;
       if (buttons.pressed & BTN_DOWN) {
         TriggerNote(4, 3, 23, 255);
         if (++selection == 3)
@@ -2349,30 +3735,38 @@ int main()
         if (--selection == 255)
           selection = 2;
       }
+      if (selection != prevSelection) {
+        TitleBar(prevSelection, TILE_BACKGROUND);
+        TitleBar(selection, TILE_TITLE_LASER);
+      }
         
       if ((buttons.pressed & BTN_A) || (buttons.pressed & BTN_START)) {
         if (selection == 0) {
           break;
         } else if (selection == 1) {
           TriggerNote(4, 3, 23, 255);
+          STACKMON_ENTER(STACKMON_CONTROLS);
           ClearVram();
+          RamFont_Load(ramfont_controls, sizeof(ramfont_controls), 0x00, 0xad);
           RamFont_Print(2, 2, pgm_instructions1, sizeof(pgm_instructions1));
           RamFont_Print(5, 4, pgm_instructions2, sizeof(pgm_instructions2));
           RamFont_Print(2, 6, pgm_instructions3, sizeof(pgm_instructions3));
 
-          RamFont_Print(2, 10, pgm_instructions4, sizeof(pgm_instructions4));
+          RamFont_Print(2, 11, pgm_instructions4, sizeof(pgm_instructions4));
           RamFont_Print(6, 13, pgm_instructions5, sizeof(pgm_instructions5));
-          RamFont_Print(6, 16, pgm_instructions6, sizeof(pgm_instructions6));
-          RamFont_Print(3, 19, pgm_instructions7, sizeof(pgm_instructions7));
-          RamFont_Print(3, 22, pgm_instructions8, sizeof(pgm_instructions8));
-          RamFont_Print(1, 25, pgm_instructions9, sizeof(pgm_instructions9));
+          RamFont_Print(6, 15, pgm_instructions6, sizeof(pgm_instructions6));
+          RamFont_Print(6, 17, pgm_instructions7, sizeof(pgm_instructions7));
+          RamFont_Print(6, 19, pgm_instructions8, sizeof(pgm_instructions8));
+          RamFont_Print(3, 21, pgm_instructions11, sizeof(pgm_instructions11));
+          RamFont_Print(1, 23, pgm_instructions9, sizeof(pgm_instructions9));
+          RamFont_Print(2, 25, pgm_instructions10, sizeof(pgm_instructions10));
 
           for (;;) {
             WaitVsync(1);
             
             // Read the current state of the player's controller
             buttons.prev = buttons.held;
-            buttons.held = ReadJoypad(0);
+            buttons.held = ReadInput();
             buttons.pressed = buttons.held & (buttons.held ^ buttons.prev);
             buttons.released = buttons.prev & (buttons.held ^ buttons.prev);
 
@@ -2383,67 +3777,19 @@ int main()
           }
         } else if (selection == 2) {
           TriggerNote(4, 3, 23, 255);
+          STACKMON_ENTER(STACKMON_TOKENS);
           ClearVram();
           SetTileTable(tileset);
+          RamFont_Load(ramfont_tokens, sizeof(ramfont_tokens), 0x00, 0xad);
           
           uint8_t piece = 0;
+          DrawTokensPage(piece);
           for (;;) {
             WaitVsync(1);
 
-            RamFont_Print(10, 26, pgm_press_a1, sizeof(pgm_press_a1));
-
-            switch (piece) {
-            case 0:
-              RamFont_Print(2, 2, pgm_laser, sizeof(pgm_laser));
-              DrawMap(13, 12, map_laser_b);
-              break;
-            case 1:
-              RamFont_Print(2, 2, pgm_target, sizeof(pgm_target));
-              RamFont_Print(8, 2, pgm_comma, sizeof(pgm_comma));
-              RamFont_Print(10, 2, pgm_mirror, sizeof(pgm_mirror));
-              DrawMap(13, 12, map_mirror_target_req_tr);
-              RamFont_Print(2, 20, pgm_must, sizeof(pgm_must));
-              RamFont_Print(7, 20, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
-              RamFont_Print(20, 20, pgm_target, sizeof(pgm_target));
-              RamFont_Print(26, 20, pgm_comma, sizeof(pgm_comma));
-              RamFont_Print(2, 22, pgm_can, sizeof(pgm_can));
-              RamFont_Print(6, 22, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
-              RamFont_Print(19, 22, pgm_mirror, sizeof(pgm_mirror));
-              break;
-            case 2:
-              RamFont_Print(2, 2, pgm_target, sizeof(pgm_target));
-              RamFont_Print(8, 2, pgm_comma, sizeof(pgm_comma));
-              RamFont_Print(10, 2, pgm_mirror, sizeof(pgm_mirror));
-              DrawMap(13, 12, map_mirror_target_opt_tr);
-              RamFont_Print(2, 20, pgm_can, sizeof(pgm_can));
-              RamFont_Print(6, 20, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
-              RamFont_Print(19, 20, pgm_target, sizeof(pgm_target));
-              RamFont_Print(25, 20, pgm_comma, sizeof(pgm_comma));
-              RamFont_Print(2, 22, pgm_can, sizeof(pgm_can));
-              RamFont_Print(6, 22, pgm_be_used_as_a, sizeof(pgm_be_used_as_a));
-              RamFont_Print(19, 22, pgm_mirror, sizeof(pgm_mirror));
-              break;
-            case 3:
-              RamFont_Print(2, 2, pgm_beam_splitter, sizeof(pgm_beam_splitter));
-              DrawMap(13, 12, map_split_tlbr);
-              break;
-            case 4:
-              RamFont_Print(2, 2, pgm_double_mirror, sizeof(pgm_double_mirror));
-              DrawMap(13, 12, map_dbl_mirror_tlbr);
-              break;
-            case 5:
-              RamFont_Print(2, 2, pgm_checkpoint, sizeof(pgm_checkpoint));
-              DrawMap(13, 12, map_checkpoint_tcbc);
-              break;
-            case 6:
-              RamFont_Print(2, 2, pgm_cell_blocker, sizeof(pgm_cell_blocker));
-              DrawMap(13, 12, map_cell_blocker);
-	      RamFont_Print(2, 20, pgm_this_does_not, sizeof(pgm_this_does_not));
-              break;
-            }
             // Read the current state of the player's controller
             buttons.prev = buttons.held;
-            buttons.held = ReadJoypad(0);
+            buttons.held = ReadInput();
             buttons.pressed = buttons.held & (buttons.held ^ buttons.prev);
             buttons.released = buttons.prev & (buttons.held ^ buttons.prev);
 
@@ -2454,28 +3800,33 @@ int main()
                 goto title_screen;
               }
               TriggerNote(4, 3, 23, 255);
-
-              ClearVram();
+              DrawTokensPage(piece);
             }
           }
         }
       }
     }
   
-    SetUserRamTilesCount(0);
+    RamFont_Unload();
   }
   
   // END TITLE SCREEN
+
+  STACKMON_ENTER(STACKMON_GAME);
   
   memset(&buttons, 0, sizeof(BUTTON_INFO));
 
-  ClearVram();
   SetTileTable(tileset);
   SetSpritesTileBank(0, mysprites);
   SetSpritesTileBank(1, tileset);
 
   StartSong(midisong);
 
+#if LEVEL_PACK
+  LevelPack_Open();
+#endif
+  Progress_Load();
+  DrawGameScreen();
   uint8_t currentLevel = 1;
   LoadLevel(currentLevel, false);
   
@@ -2483,19 +3834,42 @@ int main()
   sprites[MAX_SPRITES - 1].x = 7 * TILE_WIDTH;
   sprites[MAX_SPRITES - 1].y = 24 * TILE_HEIGHT;
   uint8_t saved_cursor_x = 0;
+  bool beamActive = false;
 
   bool flashNext = false;
   uint8_t flashCounter = 0;
-  
+  uint8_t selectFrames = 0xFF; // how long SELECT has been held, 0xFF once it has done something
+
   for (;;) {
+    PROFILE_END_FRAME();
+    STACKMON_END_FRAME();
     WaitVsync(1);
+    PROFILE_BEGIN_FRAME();
+    Stats_Frame();
  
     // Read the current state of the player's controller
     buttons.prev = buttons.held;
-    buttons.held = ReadJoypad(0);
+    buttons.held = ReadInput();
     buttons.pressed = buttons.held & (buttons.held ^ buttons.prev);
     buttons.released = buttons.prev & (buttons.held ^ buttons.prev);
 
+    // Jump straight to any level, unless the laser is on or a piece is held
+    if ((buttons.pressed & BTN_START) && !beamActive && !(buttons.held & BTN_Y) && (old_piece == -1)) {
+      uint8_t level = LevelSelect(currentLevel, &buttons);
+      DrawGameScreen();
+      flashNext = false;
+      flashCounter = 0;
+      if (level) {
+        currentLevel = level;
+        LoadLevel(currentLevel, false);
+        if (shareRestore)
+          Share_Decode(true);
+      } else {
+        DrawLevel(currentLevel, false); // as it was left
+      }
+      continue;
+    }
+
     // This "solution view" is for debug purposes only!
     /* if (buttons.pressed & BTN_START) */
     /*   LoadLevel(currentLevel, true); */
@@ -2512,13 +3886,26 @@ int main()
       ++flashCounter;
     }
 
-    // Allow song to be paused/unpaused
-    if (buttons.pressed & BTN_SELECT) {
+    // Any button puts the blinking hint cell back, before it can be changed
+    Hint_Update(buttons.pressed != 0);
+
+    /* A tap of SELECT pauses/unpauses the song, and holding it asks for a
+       hint, unless the laser is on or a piece is held */
+    if (buttons.pressed & BTN_SELECT)
+      selectFrames = 0;
+    if ((buttons.held & BTN_SELECT) && (selectFrames != 0xFF) && (++selectFrames == HINT_HOLD_FRAMES)) {
+      selectFrames = 0xFF; // until SELECT is released
+      if (!beamActive && !(buttons.held & BTN_Y) && (old_piece == -1))
+        Hint_Start(currentLevel);
+    }
+    if ((buttons.released & BTN_SELECT) && (selectFrames != 0xFF)) {
       if (IsSongPlaying())
         StopSong();
       else
         ResumeSong();
     }
+
+    PROFILE_MARK(PROFILE_INPUT);
     
     if (buttons.pressed & BTN_Y) {
       // Hide the cursor when the laser is on
@@ -2526,33 +3913,47 @@ int main()
 
       if (!(buttons.held & BTN_A)) { // Don't turn the laser on if you are dragging and dropping
         sprites[MAX_SPRITES - 1].x = OFF_SCREEN;
-        memset(laser, 0, sizeof(laser));
-        for (uint8_t i = 0; i < 100; ++i)
-          SimulatePhoton();
-      
-        DrawLaser();
+        Beam_Start();
+        beamActive = true;
+        Stats_Count(STATS_LASERS);
+      }
+    } else if (buttons.released & BTN_Y) {
+      beamActive = false;
+      EraseLaser();
+      // Restore the cursor when the laser is off
+      sprites[MAX_SPRITES - 1].x = saved_cursor_x;
+    }
+
+    // The laser sweeps across the board over a number of frames
+    if (beamActive) {
+      bool tracing = Beam_Update();
+      PROFILE_MARK(PROFILE_BEAM);
+      if (!tracing) {
+        beamActive = false;
         // Check to see if the puzzle has been solved
-        const uint16_t offset = (currentLevel - 1) * LEVEL_SIZE + 25;
         bool win = true;
-        for (uint8_t y = 0; y < 5; ++y)
-          for (uint8_t x = 0; x < 5; ++x) {
-            uint8_t piece = (uint8_t)pgm_read_byte(&levelData[offset + y * 5 + x]);
+        for (uint8_t y = 0; y < BOARD_HEIGHT; ++y)
+          for (uint8_t x = 0; x < BOARD_WIDTH; ++x) {
+            uint8_t piece = LevelByte(currentLevel, BOARD_CELLS + y * BOARD_WIDTH + x);
             if ((board[y][x] & 0x1F) != piece)
               win = false;
           }
+        PROFILE_MARK(PROFILE_DRAW);
+        PROFILE_END_FRAME();
         if (win) {
           TriggerNote(4, 5, 15, 255);
+          Progress_SetSolved(currentLevel);
+          Stats_Solved();
           flashNext = true;
           WaitVsync(150);
         } else {
           WaitVsync(10);
         }
+        PROFILE_BEGIN_FRAME();
       }
-    } else if (buttons.released & BTN_Y) {
-      EraseLaser();
-      // Restore the cursor when the laser is off
-      sprites[MAX_SPRITES - 1].x = saved_cursor_x;
     }
+
+    PROFILE_MARK(PROFILE_DRAW);
         
 #define CUR_SPEED 2
 #define X_LB (1 * TILE_WIDTH)
@@ -2591,51 +3992,30 @@ int main()
       }
       // Dragging
       if (old_piece != -1) {
-        MoveSprite(MAX_SPRITES - 10, sprites[MAX_SPRITES - 1].x - 8, sprites[MAX_SPRITES - 1].y - 8, 3, 3);
+        MoveDragSprites();
         // Highlight blank squares when we're hovering over them
-        uint8_t tx = sprites[MAX_SPRITES - 1].x / TILE_WIDTH;
-        uint8_t ty = sprites[MAX_SPRITES - 1].y / TILE_HEIGHT;
-        if ((ty >= 1) && (ty <= 19) && (tx >= 9) && (tx <= 27)) { // from grid
-          int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-          int8_t y = pgm_read_byte(&hitMap[ty - 1]);
-          if ((x >= 0) && (y >= 0)) {
-            if ((board[y][x] & 0x1F) == P_BLANK)
-              DrawMap(9 + x * 4, 1 + y * 4, map_blank_highlight);
-          } else {
-            for (uint8_t y = 0; y < 5; ++y)
-              for (uint8_t x = 0; x < 5; ++x)
-                if ((board[y][x] & 0x1F) == P_BLANK)
-                  DrawMap(9 + x * 4, 1 + y * 4, map_blank);
-          }
-        } else if ((ty >= 23) && (ty <= 25) && (tx >= 9) && (tx <= 27)) { // from hand
-          int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-          if ((x >= 0)) {
-            if ((hand[x] & 0x1F) == P_BLANK)
-              DrawMap(9 + x * 4, 23, map_blank_highlight);
-          } else {
-            for (uint8_t x = 0; x < 5; ++x)
-              if ((hand[x] & 0x1F) == P_BLANK)
-                DrawMap(9 + x * 4, 23, map_blank);
-          }
-        } else {
-          for (uint8_t y = 0; y < 5; ++y)
-            for (uint8_t x = 0; x < 5; ++x)
-              if ((board[y][x] & 0x1F) == P_BLANK)
-                DrawMap(9 + x * 4, 1 + y * 4, map_blank);
-          for (uint8_t x = 0; x < 5; ++x)
-            if ((hand[x] & 0x1F) == P_BLANK)
-              DrawMap(9 + x * 4, 23, map_blank);
-        }
-        
+        int8_t x, y;
+        HitTest(&x, &y);
+        if ((y >= 0) && (y < HAND_ROW) && ((board[y][x] & 0x1F) != P_BLANK)) // on grid
+          x = y = -1;
+        else if ((y == HAND_ROW) && ((hand[x] & 0x1F) != P_BLANK)) // on hand
+          x = y = -1;
+        SetHighlight(x, y);
       }
     }
 
-    // Process rotations
+    PROFILE_MARK(PROFILE_SPRITES);
+
+    // Process rotations, and undo and redo
     if (!(buttons.held & BTN_Y)) { // Don't process rotations if the laser is on
-      if ((buttons.pressed & BTN_X) || (buttons.pressed & BTN_SR))
-        TryRotation(rotateClockwise);
-      else if ((buttons.pressed & BTN_B) || (buttons.pressed & BTN_SL))
-        TryRotation(rotateCounterClockwise);
+      if (buttons.pressed & BTN_X)
+        TryRotation(true);
+      else if (buttons.pressed & BTN_B)
+        TryRotation(false);
+      else if ((buttons.pressed & BTN_SL) && (old_piece == -1) && Journal_Undo())
+        TriggerNote(4, 4, 23, 255);
+      else if ((buttons.pressed & BTN_SR) && (old_piece == -1) && Journal_Redo())
+        TriggerNote(4, 3, 23, 255);
     }
     
     // Process any "mouse" clicks
@@ -2645,16 +4025,20 @@ int main()
       if ((ty >= PREV_NEXT_Y - 1) && (ty <= PREV_NEXT_Y + 1)) {
         if ((tx >= PREV_NEXT_X) && (tx <= PREV_NEXT_X + 1)) {
           if (--currentLevel == 0)
-            currentLevel = LEVELS;
+            currentLevel = levelCount;
           TriggerNote(4, 3, 23, 255);
+          if (flashNext)
+            DrawMap(PREV_NEXT_X + 2, PREV_NEXT_Y, map_next);
           flashNext = false;
           flashCounter = 0;
           LoadLevel(currentLevel, false);
         }
         if ((tx >= PREV_NEXT_X + 2) && (tx <= PREV_NEXT_X + 3)) {
-          if (++currentLevel == LEVELS + 1)
+          if (++currentLevel > levelCount)
             currentLevel = 1;
           TriggerNote(4, 3, 23, 255);
+          if (flashNext)
+            DrawMap(PREV_NEXT_X + 2, PREV_NEXT_Y, map_next);
           flashNext = false;
           flashCounter = 0;
           LoadLevel(currentLevel, false);
@@ -2662,67 +4046,76 @@ int main()
       }
 
       // Drag and drop
-      if ((ty >= 1) && (ty <= 19) && (tx >= 9) && (tx <= 27)) { // from grid
-        int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-        int8_t y = pgm_read_byte(&hitMap[ty - 1]);
-        if ((x >= 0) && (y >= 0) && !(board[y][x] & 0x80) && !(board[y][x] & 0x40) && (board[y][x] != P_BLANK)) { // respect lock bit
+      int8_t x, y;
+      HitTest(&x, &y);
+      if ((y >= 0) && (y < HAND_ROW)) { // from grid
+        if (!(board[y][x] & (PF_LOCK | PF_ROTATE)) && (board[y][x] != P_BLANK)) {
           old_piece = board[y][x];
           old_x = x;
           old_y = y;
-          DrawMap(9 + x * 4, 1 + y * 4, map_blank);
+          dragFrom = CellNo(x, y);
+          dragTurns = 0;
+          VramQueue_Map(CELL_TILE_X(x), CELL_TILE_Y(y), map_blank);
           board[y][x] = P_BLANK;
           MapSprite2(MAX_SPRITES - 10, MapName(old_piece), SPRITE_BANK1);
-          MoveSprite(MAX_SPRITES - 10, sprites[MAX_SPRITES - 1].x - 8, sprites[MAX_SPRITES - 1].y - 8, 3, 3);
+          MoveDragSprites();
           TriggerNote(4, 3, 23, 255);
         }
-      } else if ((ty >= 23) && (ty <= 25) && (tx >= 9) && (tx <= 27)) { // from hand
-        int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-        if ((x >= 0) && (hand[x] != P_BLANK)) {
+      } else if (y == HAND_ROW) { // from hand
+        if (hand[x] != P_BLANK) {
           old_piece = hand[x];
           old_x = x;
-          old_y = 5; // this piece came from hand
-          DrawMap(9 + x * 4, 23, map_blank);
+          old_y = HAND_ROW; // this piece came from hand
+          dragFrom = CellNo(x, HAND_ROW);
+          dragTurns = 0;
+          VramQueue_Map(CELL_TILE_X(x), HAND_TOP, map_blank);
           hand[x] = P_BLANK;
           MapSprite2(MAX_SPRITES - 10, MapName(old_piece), SPRITE_BANK1);
-          MoveSprite(MAX_SPRITES - 10, sprites[MAX_SPRITES - 1].x - 8, sprites[MAX_SPRITES - 1].y - 8, 3, 3);
+          MoveDragSprites();
           TriggerNote(4, 3, 23, 255);
         }
       }
       
     } else if (buttons.released & BTN_A) {
       if ((old_piece != -1) && (old_y != -1)) { // valid piece is being held
-        uint8_t tx = sprites[MAX_SPRITES - 1].x / TILE_WIDTH;
-        uint8_t ty = sprites[MAX_SPRITES - 1].y / TILE_HEIGHT;
         // Figure out where to drop it
-        if ((ty >= 1) && (ty <= 19) && (tx >= 9) && (tx <= 27)) { // to grid
-          int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-          int8_t y = pgm_read_byte(&hitMap[ty - 1]);
-          if ((x >= 0) && (y >= 0) && ((board[y][x] & 0x1F) == P_BLANK)) {
+        int8_t x, y;
+        HitTest(&x, &y);
+        if ((y >= 0) && (y < HAND_ROW)) { // to grid
+          if ((board[y][x] & 0x1F) == P_BLANK) {
             old_x = x;
             old_y = y;
           }
-        } else if ((ty >= 23) && (ty <= 25) && (tx >= 9) && (tx <= 27)) { // to hand
-          int8_t x = pgm_read_byte(&hitMap[tx - 9]);
-          if ((x >= 0) && ((hand[x] & 0x1F) == P_BLANK)) {
+        } else if (y == HAND_ROW) { // to hand
+          if ((hand[x] & 0x1F) == P_BLANK) {
             old_x = x;
-            old_y = 5; // hand
+            old_y = HAND_ROW; // hand
           }
         }
         
         // Drop it like it's hot
         for (uint8_t i = 0; i < 9; ++i)
           sprites[i + MAX_SPRITES - 10].x = OFF_SCREEN;
-        if (old_y == 5) {
-          DrawMap(9 + old_x * 4, 23, MapName(old_piece));
+        SetHighlight(-1, -1);
+        if (old_y == HAND_ROW) {
+          VramQueue_Map(CELL_TILE_X(old_x), HAND_TOP, MapName(old_piece));
           hand[old_x] = old_piece;
         } else {
-          DrawMap(9 + old_x * 4, 1 + old_y * 4, MapName(old_piece));
+          VramQueue_Map(CELL_TILE_X(old_x), CELL_TILE_Y(old_y), MapName(old_piece));
           board[old_y][old_x] = old_piece;
         }
+        Journal_Record(dragFrom, CellNo(old_x, old_y), dragTurns);
         old_piece = old_x = old_y = -1;
         TriggerNote(4, 4, 23, 255);
       }
     }
-    
+
+#if LEVEL_PACK
+    // Reading the card takes a while, so it is only done when nothing is going on
+    if (!beamActive && (old_piece == -1) && !buttons.held)
+      LevelPack_Prefetch();
+#endif
+
+    PROFILE_MARK(PROFILE_DRAW);
   }
 }
@@ -0,0 +1,451 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Converts the piece definitions in data/pieces.txt into data/pieces.inc
+
+  Everything the game needs to know about a piece comes from here: its
+  P_* code, its map, how it rotates, how the laser goes through it, and
+  which map to draw for the parts of it that the laser lights up. See
+  pieces.txt for the format.
+
+  Identical beam rows and lists of parts are only emitted once. If the
+  tileset's .xml file is given as well, the maps are checked against it.
+*/
+
+#define MAX_PIECES 32 // the board keeps the piece in 5 bits
+#define MAX_NAME 32
+#define MAX_PARTS 8
+#define MAX_PATHS 32
+#define MAX_RULES 16
+
+// These must match laser2.c
+#define D_OUT_T 1
+#define D_OUT_B 2
+#define D_OUT_L 4
+#define D_OUT_R 8
+#define B_TARGET 0x10
+#define LIT_ANY 0xFF
+
+typedef struct {
+  uint8_t mask;
+  uint8_t part;
+} PATH;
+
+typedef struct {
+  uint8_t parts;
+  char map[MAX_NAME];
+} RULE;
+
+typedef struct {
+  char name[MAX_NAME];
+  char map[MAX_NAME];
+  char unknown[MAX_NAME]; // the default direction of an unknown rotation
+  uint8_t beam[4];
+  char part_names[MAX_PARTS][MAX_NAME];
+  size_t part_count;
+  PATH paths[MAX_PATHS];
+  size_t path_count;
+  RULE rules[MAX_RULES];
+  size_t rule_count;
+  int clockwise;
+  int counter_clockwise;
+} PIECE;
+
+PIECE pieces[MAX_PIECES];
+size_t count;
+
+const char* filename;
+int lineno;
+
+void error(const char* message, const char* detail)
+{
+  fprintf(stderr, "%s:%d: %s%s\n", filename, lineno, message, detail ? detail : "");
+  exit(-1);
+}
+
+int find_piece(const char* name)
+{
+  for (size_t i = 0; i < count; ++i)
+    if (strcmp(pieces[i].name, name) == 0)
+      return (int)i;
+  return -1;
+}
+
+// Returns the D_OUT_* bit for one of "tblr"
+uint8_t side_bit(char c)
+{
+  switch (c) {
+  case 't': return D_OUT_T;
+  case 'b': return D_OUT_B;
+  case 'l': return D_OUT_L;
+  case 'r': return D_OUT_R;
+  }
+  error("expected one of t, b, l or r, not ", (char[]){ c, 0 });
+  return 0;
+}
+
+void copy_name(char* dst, const char* src)
+{
+  if (strlen(src) >= MAX_NAME)
+    error("name is too long: ", src);
+  strcpy(dst, src);
+}
+
+void parse_beam(PIECE* p, char* tokens[], int n)
+{
+  if (n != 4)
+    error("expected t:, b:, l: and r:", NULL);
+  for (int i = 0; i < 4; ++i) {
+    const char* t = tokens[i];
+    if (t[0] != "tblr"[i] || t[1] != ':' || !t[2])
+      error("expected the sides in the order t:, b:, l:, r:, not ", t);
+    uint8_t out = 0;
+    if (strcmp(t + 2, "*") == 0)
+      out = B_TARGET;
+    else if (strcmp(t + 2, "-") != 0)
+      for (const char* c = t + 2; *c; ++c)
+        out |= side_bit(*c);
+    int sides = !!(out & D_OUT_T) + !!(out & D_OUT_B) + !!(out & D_OUT_L) + !!(out & D_OUT_R);
+    if (sides > 2)
+      error("the laser can only go out of one or two sides: ", t);
+    if ((sides == 2) && !(out & (side_bit(t[0]) == D_OUT_T ? D_OUT_B :
+                                 side_bit(t[0]) == D_OUT_B ? D_OUT_T :
+                                 side_bit(t[0]) == D_OUT_L ? D_OUT_R : D_OUT_L)))
+      error("a splitter has to let the laser straight through: ", t);
+    p->beam[i] = out;
+  }
+}
+
+void parse_part(PIECE* p, char* tokens[], int n)
+{
+  if (n < 2)
+    error("expected a part name and its paths", NULL);
+  if (p->part_count == MAX_PARTS)
+    error("too many parts", NULL);
+  for (size_t i = 0; i < p->part_count; ++i)
+    if (strcmp(p->part_names[i], tokens[0]) == 0)
+      error("part is already defined: ", tokens[0]);
+  uint8_t bit = 1 << p->part_count;
+  copy_name(p->part_names[p->part_count++], tokens[0]);
+  for (int i = 1; i < n; ++i) {
+    const char* t = tokens[i];
+    uint8_t mask = 0;
+    if (t[0] != '-')
+      mask = side_bit(t[0]) << 4; // D_IN_* are the D_OUT_* bits shifted up
+    for (const char* c = t + 1; *c; ++c)
+      mask |= side_bit(*c);
+    if (!mask)
+      error("empty path: ", t);
+    if (p->path_count == MAX_PATHS)
+      error("too many paths", NULL);
+    p->paths[p->path_count].mask = mask;
+    p->paths[p->path_count].part = bit;
+    ++p->path_count;
+  }
+}
+
+void parse_lit(PIECE* p, char* tokens[], int n)
+{
+  if (n != 2)
+    error("expected the lit parts and a map", NULL);
+  if (p->rule_count == MAX_RULES)
+    error("too many lit lines", NULL);
+  uint8_t parts = 0;
+  if (strcmp(tokens[0], "any") == 0) {
+    parts = LIT_ANY;
+  } else {
+    for (char* name = strtok(tokens[0], "+"); name; name = strtok(NULL, "+")) {
+      size_t i;
+      for (i = 0; i < p->part_count; ++i)
+        if (strcmp(p->part_names[i], name) == 0)
+          break;
+      if (i == p->part_count)
+        error("no such part: ", name);
+      parts |= 1 << i;
+    }
+  }
+  for (size_t i = 0; i < p->rule_count; ++i)
+    if (p->rules[i].parts == LIT_ANY)
+      error("\"lit any\" has to be the last lit line", NULL);
+  p->rules[p->rule_count].parts = parts;
+  copy_name(p->rules[p->rule_count].map, tokens[1]);
+  ++p->rule_count;
+}
+
+void parse_rotate(char* tokens[], int n)
+{
+  if (n < 2)
+    error("expected at least two pieces", NULL);
+  for (int i = 0; i < n; ++i) {
+    int piece = find_piece(tokens[i]);
+    if (piece < 0)
+      error("no such piece: ", tokens[i]);
+    if (pieces[piece].clockwise != piece)
+      error("piece is already in a rotate line: ", tokens[i]);
+    int next = find_piece(tokens[(i + 1) % n]);
+    if (next < 0)
+      error("no such piece: ", tokens[(i + 1) % n]);
+    pieces[piece].clockwise = next;
+    pieces[next].counter_clockwise = piece;
+  }
+}
+
+// Returns true if the map is defined in the tileset's .xml file
+bool map_exists(const char* xml, const char* map)
+{
+  char needle[MAX_NAME + 16];
+  snprintf(needle, sizeof(needle), "var-name=\"%s\"", map);
+  return strstr(xml, needle) != NULL;
+}
+
+char* read_file(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", path);
+    exit(-1);
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char* data = malloc(size + 1);
+  if (fread(data, 1, size, fp) != (size_t)size) {
+    fprintf(stderr, "Error: Unable to read \"%s\"\n", path);
+    exit(-1);
+  }
+  data[size] = 0;
+  fclose(fp);
+  return data;
+}
+
+void print_mask(uint8_t mask)
+{
+  printf("0x%02x", mask);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s pieces.txt [tileset.xml] > pieces.inc\n", argv[0]);
+    return -1;
+  }
+
+  filename = argv[1];
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", filename);
+    return -1;
+  }
+
+  char line[256];
+  PIECE* current = NULL;
+  while (fgets(line, sizeof(line), fp)) {
+    ++lineno;
+    line[strcspn(line, "#\r\n")] = 0;
+    char* tokens[MAX_PATHS + 2];
+    int n = 0;
+    for (char* t = strtok(line, " \t"); t; t = strtok(NULL, " \t")) {
+      if (n == MAX_PATHS + 2)
+        error("line is too long", NULL);
+      tokens[n++] = t;
+    }
+    if (n == 0)
+      continue;
+
+    if (strcmp(tokens[0], "piece") == 0 || strcmp(tokens[0], "unknown") == 0) {
+      if (n != 3)
+        error("expected a name, and a map or default direction", NULL);
+      if (count == MAX_PIECES)
+        error("too many pieces", NULL);
+      if (find_piece(tokens[1]) >= 0)
+        error("piece is already defined: ", tokens[1]);
+      current = &pieces[count];
+      memset(current, 0, sizeof(*current));
+      copy_name(current->name, tokens[1]);
+      if (tokens[0][0] == 'p')
+        copy_name(current->map, tokens[2]);
+      else
+        copy_name(current->unknown, tokens[2]);
+      current->clockwise = current->counter_clockwise = count;
+      ++count;
+    } else if (strcmp(tokens[0], "rotate") == 0) {
+      parse_rotate(tokens + 1, n - 1);
+    } else if (!current) {
+      error("expected a piece first", NULL);
+    } else if (current->unknown[0]) {
+      error("a piece with an unknown rotation takes after its default direction", NULL);
+    } else if (strcmp(tokens[0], "beam") == 0) {
+      parse_beam(current, tokens + 1, n - 1);
+    } else if (strcmp(tokens[0], "part") == 0) {
+      parse_part(current, tokens + 1, n - 1);
+    } else if (strcmp(tokens[0], "lit") == 0) {
+      parse_lit(current, tokens + 1, n - 1);
+    } else {
+      error("unknown keyword: ", tokens[0]);
+    }
+  }
+  fclose(fp);
+
+  // Resolve the default directions
+  for (size_t i = 0; i < count; ++i) {
+    PIECE* p = &pieces[i];
+    lineno = 0;
+    if (!p->unknown[0])
+      continue;
+    int d = find_piece(p->unknown);
+    if (d < 0 || pieces[d].unknown[0])
+      error("not a piece with a known rotation: ", p->unknown);
+    strcpy(p->map, pieces[d].map);
+  }
+
+  if (argc == 3) {
+    char* xml = read_file(argv[2]);
+    for (size_t i = 0; i < count; ++i) {
+      if (!map_exists(xml, pieces[i].map))
+        error("map is not in the tileset: ", pieces[i].map);
+      for (size_t r = 0; r < pieces[i].rule_count; ++r)
+        if (!map_exists(xml, pieces[i].rules[r].map))
+          error("map is not in the tileset: ", pieces[i].rules[r].map);
+    }
+    free(xml);
+  }
+
+  printf("/*\n");
+  printf(" * Generated by piecegen from pieces.txt, do not edit\n");
+  printf(" *\n");
+  printf(" * beamPaths has a row for each kind of beam behaviour, with the sides\n");
+  printf(" * the laser goes out of (D_OUT_*) when it comes in from the top,\n");
+  printf(" * bottom, left and right. No side stops it, and B_TARGET lights up\n");
+  printf(" * the side it came in from as well.\n");
+  printf(" *\n");
+  printf(" * litParts lists the laser bits that light up each part of a piece,\n");
+  printf(" * and litRules the map to draw for the parts that are lit. Both lists\n");
+  printf(" * end with a 0.\n");
+  printf(" */\n\n");
+
+  for (size_t i = 0; i < count; ++i)
+    printf("#define P_%s %zu\n", pieces[i].name, i);
+  printf("#define P_COUNT %zu\n\n", count);
+
+  printf("#define PF_LOCK 0x80   // it can't be moved or rotated\n");
+  printf("#define PF_ROTATE 0x40 // it can be rotated, but not moved\n");
+  printf("#define B_TARGET 0x%02x\n", B_TARGET);
+  printf("#define LIT_ANY 0x%02x\n\n", LIT_ANY);
+
+  printf("typedef struct {\n");
+  printf("  const VRAM_PTR_TYPE* map;\n");
+  printf("  uint8_t flags; // PF_ROTATE for an unknown rotation, PF_LOCK otherwise\n");
+  printf("  uint8_t direction; // the default direction, or the piece itself\n");
+  printf("  uint8_t clockwise;\n");
+  printf("  uint8_t counterClockwise;\n");
+  printf("  uint8_t beam; // row of beamPaths\n");
+  printf("  uint8_t parts; // first entry of litParts\n");
+  printf("  uint8_t rules; // first entry of litRules\n");
+  printf("} PIECE_INFO;\n\n");
+  printf("typedef struct {\n");
+  printf("  uint8_t mask;\n");
+  printf("  uint8_t part;\n");
+  printf("} LIT_PART;\n\n");
+  printf("typedef struct {\n");
+  printf("  uint8_t parts;\n");
+  printf("  const VRAM_PTR_TYPE* map;\n");
+  printf("} LIT_RULE;\n\n");
+
+  // Beam rows, starting with the one that stops the laser from every side
+  static uint8_t beams[MAX_PIECES][4];
+  size_t beam_count = 1;
+  int beam_of[MAX_PIECES];
+  for (size_t i = 0; i < count; ++i) {
+    size_t b;
+    for (b = 0; b < beam_count; ++b)
+      if (memcmp(beams[b], pieces[i].beam, 4) == 0)
+        break;
+    if (b == beam_count)
+      memcpy(beams[beam_count++], pieces[i].beam, 4);
+    beam_of[i] = b;
+  }
+  printf("const uint8_t beamPaths[][4] PROGMEM = {\n");
+  for (size_t b = 0; b < beam_count; ++b) {
+    printf("  { ");
+    for (int s = 0; s < 4; ++s) {
+      print_mask(beams[b][s]);
+      printf("%s", (s < 3) ? ", " : " },");
+    }
+    printf(" //");
+    for (size_t i = 0; i < count; ++i)
+      if (beam_of[i] == (int)b)
+        printf(" %s", pieces[i].name);
+    printf("\n");
+  }
+  printf("};\n\n");
+
+  // Lists of parts, starting with an empty one for the pieces that have none
+  int parts_of[MAX_PIECES];
+  size_t parts_size = 1;
+  printf("const LIT_PART litParts[] PROGMEM = {\n");
+  printf("  { 0, 0 },\n");
+  for (size_t i = 0; i < count; ++i) {
+    PIECE* p = &pieces[i];
+    parts_of[i] = 0;
+    if (!p->path_count)
+      continue;
+    size_t j;
+    for (j = 0; j < i; ++j)
+      if ((pieces[j].path_count == p->path_count) &&
+          (memcmp(pieces[j].paths, p->paths, p->path_count * sizeof(PATH)) == 0))
+        break;
+    if (j < i) {
+      parts_of[i] = parts_of[j];
+      continue;
+    }
+    parts_of[i] = parts_size;
+    printf(" ");
+    for (size_t k = 0; k < p->path_count; ++k) {
+      printf(" { ");
+      print_mask(p->paths[k].mask);
+      printf(", 0x%02x },", p->paths[k].part);
+    }
+    printf(" { 0, 0 }, // %s\n", p->name);
+    parts_size += p->path_count + 1;
+  }
+  printf("};\n\n");
+
+  int rules_of[MAX_PIECES];
+  size_t rules_size = 1;
+  printf("const LIT_RULE litRules[] PROGMEM = {\n");
+  printf("  { 0, 0 },\n");
+  for (size_t i = 0; i < count; ++i) {
+    PIECE* p = &pieces[i];
+    rules_of[i] = 0;
+    if (!p->rule_count)
+      continue;
+    rules_of[i] = rules_size;
+    printf("  // %s\n", p->name);
+    for (size_t r = 0; r < p->rule_count; ++r)
+      printf("  { 0x%02x, %s },\n", p->rules[r].parts, p->rules[r].map);
+    printf("  { 0, 0 },\n");
+    rules_size += p->rule_count + 1;
+  }
+  printf("};\n\n");
+
+  if (parts_size > 256 || rules_size > 256) {
+    fprintf(stderr, "Error: too many parts or lit lines for 8 bit indices\n");
+    return -1;
+  }
+
+  printf("const PIECE_INFO pieceInfo[] PROGMEM = {\n");
+  for (size_t i = 0; i < count; ++i) {
+    PIECE* p = &pieces[i];
+    printf("  { %s, %s, P_%s, P_%s, P_%s, %d, %d, %d }, // P_%s\n",
+           p->map, p->unknown[0] ? "PF_ROTATE" : "PF_LOCK",
+           p->unknown[0] ? p->unknown : p->name,
+           pieces[p->clockwise].name, pieces[p->counter_clockwise].name,
+           beam_of[i], parts_of[i], rules_of[i], p->name);
+  }
+  printf("};\n");
+
+  return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+  Converts the text definitions in data/text.txt into data/text.inc
+
+  Every screen only expands the glyphs that its own strings use into
+  RAM tiles, so each screen gets a subset of myramfont, and its strings
+  are encoded as indices into that subset instead of as ASCII.
+
+  Each string is stored as runs of non-blank characters, so printing it
+  is just a copy into VRAM. A run is two bytes, the number of blanks to
+  skip and the number of tiles that follow, and then the tiles.
+
+  Input format, one definition per line ('#' starts a comment):
+
+    screen <name>     starts a new screen, which becomes ramfont_<name>
+    glyphs <text>     loads the glyphs in the text on the screen, whether
+                      its strings use them or not
+    <name> <text>     defines pgm_<name>, using the glyphs of the screen
+
+  The text may contain A-Z, ',', '-' and spaces.
+*/
+
+#define FONT_GLYPHS 28
+
+#define MAX_STRINGS 64
+#define MAX_NAME 32
+#define MAX_TEXT 32
+
+typedef struct {
+  char name[MAX_NAME];
+  char text[MAX_TEXT];
+} STRING_DEF;
+
+// Returns the index of the glyph for c in myramfont, or -1
+int glyph_index(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c == ',')
+    return 26;
+  if (c == '-')
+    return 27;
+  return -1;
+}
+
+char screen[MAX_NAME];
+bool extra[FONT_GLYPHS]; // glyphs of the screen from glyphs lines
+STRING_DEF strings[MAX_STRINGS];
+size_t count;
+char all_names[256][MAX_NAME];
+size_t all_count;
+
+void emit_screen(void)
+{
+  if (!screen[0])
+    return;
+
+  bool used[FONT_GLYPHS];
+  memcpy(used, extra, sizeof(used));
+  for (size_t i = 0; i < count; ++i)
+    for (const char* p = strings[i].text; *p; ++p)
+      if (*p != ' ')
+        used[glyph_index(*p)] = true;
+
+  int remap[FONT_GLYPHS];
+  size_t glyphs = 0;
+  printf("// %s\n", screen);
+  printf("const uint8_t ramfont_%s[] PROGMEM = {\n  ", screen);
+  for (int g = 0; g < FONT_GLYPHS; ++g)
+    if (used[g]) {
+      remap[g] = glyphs++;
+      printf("%d, ", g);
+    }
+  printf("\n};\n");
+
+  for (size_t i = 0; i < count; ++i) {
+    printf("const uint8_t pgm_%s[] PROGMEM = { ", strings[i].name);
+    const char* p = strings[i].text;
+    for (;;) {
+      size_t skip = strspn(p, " ");
+      p += skip;
+      size_t len = strcspn(p, " ");
+      if (!len)
+        break;
+      printf("%zu, %zu, ", skip, len);
+      for (; len; --len)
+        printf("%d, ", remap[glyph_index(*p++)]);
+    }
+    printf("}; // %s\n", strings[i].text);
+  }
+  printf("\n");
+
+  memset(extra, 0, sizeof(extra));
+  count = 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s text.txt > text.inc\n", argv[0]);
+    return -1;
+  }
+
+  FILE* fp = fopen(argv[1], "r");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", argv[1]);
+    return -1;
+  }
+
+  printf("/*\n");
+  printf(" * Generated by textgen from text.txt, do not edit\n");
+  printf(" *\n");
+  printf(" * ramfont_<screen> lists the glyphs of myramfont that a screen uses,\n");
+  printf(" * and its strings hold runs of indices into that list: blanks to skip,\n");
+  printf(" * number of tiles, tiles\n");
+  printf(" */\n\n");
+
+  char line[256];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == '#' || line[0] == 0)
+      continue;
+
+    char* text = strchr(line, ' ');
+    if (!text) {
+      fprintf(stderr, "%s:%d: expected a name and some text\n", argv[1], lineno);
+      return -1;
+    }
+    *text++ = 0;
+    if (strlen(line) >= MAX_NAME || strlen(text) >= MAX_TEXT) {
+      fprintf(stderr, "%s:%d: name or text is too long\n", argv[1], lineno);
+      return -1;
+    }
+
+    if (strcmp(line, "screen") == 0) {
+      emit_screen();
+      strcpy(screen, text);
+      continue;
+    }
+
+    if (!screen[0]) {
+      fprintf(stderr, "%s:%d: string defined before any screen\n", argv[1], lineno);
+      return -1;
+    }
+    for (const char* p = text; *p; ++p)
+      if (*p != ' ' && glyph_index(*p) < 0) {
+        fprintf(stderr, "%s:%d: no glyph for '%c'\n", argv[1], lineno, *p);
+        return -1;
+      }
+
+    if (strcmp(line, "glyphs") == 0) {
+      for (const char* p = text; *p; ++p)
+        if (*p != ' ')
+          extra[glyph_index(*p)] = true;
+      continue;
+    }
+    for (size_t i = 0; i < all_count; ++i)
+      if (strcmp(all_names[i], line) == 0) {
+        fprintf(stderr, "%s:%d: pgm_%s is already defined\n", argv[1], lineno, line);
+        return -1;
+      }
+    if (count == MAX_STRINGS || all_count == 256) {
+      fprintf(stderr, "%s:%d: too many strings\n", argv[1], lineno);
+      return -1;
+    }
+
+    strcpy(all_names[all_count++], line);
+    strcpy(strings[count].name, line);
+    strcpy(strings[count].text, text);
+    ++count;
+  }
+  emit_screen();
+
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Compacts a tile table written by gconvert, to free background tile
+  indices. In video mode 3 the flash tiles share the 256 tile indices
+  with the RAM tiles, so only 256 - RAM_TILES_COUNT of them are usable.
+
+  Tiles that are identical to an earlier tile, or that no map uses, are
+  removed, and the maps are rewritten with the new indices. Tiles that
+  the game uses by index rather than through a map must be kept with -k.
+
+  Any other tables given after the first one are only checked: their
+  tiles are drawn over tile 0 (the background) of the first table, and
+  the ones that come out identical to one of its tiles are reported, as
+  those could be drawn as background tiles instead.
+
+  The file is only rewritten when something was removed.
+
+  Tiles that are only flipped or recoloured copies of another tile are
+  left alone, as mode 3 can't flip or recolour background tiles.
+*/
+
+#define TILE_SIZE 64
+#define MAX_TILES 256
+#define MAX_LINES 4096
+#define MAX_LINE 1024
+#define RAM_TILES_COUNT 28
+#define TRANSLUCENT_COLOR 0xad
+
+typedef struct {
+  char* lines[MAX_LINES];
+  size_t count;
+  size_t first_tile; // index of the line with tile 0
+  uint8_t tiles[MAX_TILES][TILE_SIZE];
+  size_t tile_count;
+} INC_FILE;
+
+int read_inc(const char* filename, INC_FILE* inc)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to open \"%s\"\n", filename);
+    return -1;
+  }
+
+  char line[MAX_LINE];
+  bool in_tiles = false;
+  inc->count = 0;
+  inc->tile_count = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (inc->count == MAX_LINES) {
+      fprintf(stderr, "Error: \"%s\" is too long\n", filename);
+      fclose(fp);
+      return -1;
+    }
+    inc->lines[inc->count] = malloc(strlen(line) + 1);
+    strcpy(inc->lines[inc->count], line);
+
+    if (in_tiles && line[0] == '}') {
+      in_tiles = false;
+    } else if (in_tiles) {
+      if (inc->tile_count == 0)
+        inc->first_tile = inc->count;
+      if (inc->tile_count == MAX_TILES) {
+        fprintf(stderr, "Error: \"%s\" has too many tiles\n", filename);
+        fclose(fp);
+        return -1;
+      }
+      // Each tile is on a line of its own, with a //tile:N comment after it
+      char* p = line;
+      for (size_t i = 0; i < TILE_SIZE; ++i) {
+        p += strcspn(p, "0123456789");
+        inc->tiles[inc->tile_count][i] = (uint8_t)strtoul(p, &p, 0);
+      }
+      ++inc->tile_count;
+    } else if (strstr(line, "[] PROGMEM={")) {
+      in_tiles = true;
+    }
+    ++inc->count;
+  }
+
+  fclose(fp);
+  if (!inc->tile_count) {
+    fprintf(stderr, "Error: No tiles found in \"%s\"\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Map data is the line after "w,h", e.g. ",0x5,0x6};"
+bool is_map_data(const INC_FILE* inc, size_t line)
+{
+  return (line >= 2) && strstr(inc->lines[line - 2], "map_") && (inc->lines[line][0] == ',');
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long keep_first = 0, keep_last = 0;
+  bool keep = false;
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-k") == 0) {
+    char* p;
+    keep_first = strtoul(argv[arg + 1], &p, 0);
+    keep_last = (*p == '-') ? strtoul(p + 1, NULL, 0) : keep_first;
+    keep = true;
+    arg += 2;
+  }
+  if (arg >= argc) {
+    fprintf(stderr, "Usage: %s [-k first-last] tileset.inc [sprites.inc...]\n", argv[0]);
+    return -1;
+  }
+
+  const char* filename = argv[arg++];
+  static INC_FILE inc;
+  if (read_inc(filename, &inc) != 0)
+    return -1;
+
+  // Find the tiles that are in use
+  bool used[MAX_TILES] = { false };
+  if (keep)
+    for (unsigned long i = keep_first; i <= keep_last && i < MAX_TILES; ++i)
+      used[i] = true;
+  for (size_t l = 0; l < inc.count; ++l)
+    if (is_map_data(&inc, l))
+      for (char* p = inc.lines[l]; (p = strchr(p, ',')); ) {
+        unsigned long t = strtoul(p + 1, &p, 0);
+        if (t >= inc.tile_count) {
+          fprintf(stderr, "Error: A map uses tile %lu, which doesn't exist\n", t);
+          return -1;
+        }
+        used[t] = true;
+      }
+
+  // A tile that is only used through a duplicate stays at the earlier place
+  for (size_t i = 0; i < inc.tile_count; ++i)
+    if (used[i])
+      for (size_t j = 0; j < i; ++j)
+        if (memcmp(inc.tiles[i], inc.tiles[j], TILE_SIZE) == 0) {
+          used[j] = true;
+          break;
+        }
+
+  // Tiles that are kept by index have to stay where they are
+  size_t remap[MAX_TILES];
+  size_t new_count = 0;
+  size_t duplicates = 0, unused = 0;
+  for (size_t i = 0; i < inc.tile_count; ++i) {
+    bool pinned = keep && i >= keep_first && i <= keep_last;
+    if (!pinned && !used[i]) {
+      ++unused;
+      remap[i] = MAX_TILES;
+      continue;
+    }
+    size_t j;
+    for (j = 0; j < i; ++j)
+      if (remap[j] != MAX_TILES && memcmp(inc.tiles[i], inc.tiles[j], TILE_SIZE) == 0)
+        break;
+    if (!pinned && j < i) {
+      ++duplicates;
+      remap[i] = remap[j];
+    } else {
+      remap[i] = new_count++;
+    }
+  }
+
+  size_t limit = MAX_TILES - RAM_TILES_COUNT;
+  fprintf(stderr, "%s: %zu tiles, %zu duplicate, %zu unused, %zu of %zu indices free\n",
+          filename, inc.tile_count, duplicates, unused,
+          (new_count < limit) ? limit - new_count : 0, limit);
+
+  // Report tiles of the other tables that already exist as background tiles
+  for (; arg < argc; ++arg) {
+    static INC_FILE other;
+    if (read_inc(argv[arg], &other) != 0)
+      return -1;
+    size_t found = 0;
+    for (size_t i = 0; i < other.tile_count; ++i) {
+      uint8_t tile[TILE_SIZE];
+      for (size_t p = 0; p < TILE_SIZE; ++p)
+        tile[p] = (other.tiles[i][p] == TRANSLUCENT_COLOR) ? inc.tiles[0][p] : other.tiles[i][p];
+      for (size_t j = 0; j < inc.tile_count; ++j)
+        if (remap[j] != MAX_TILES && memcmp(tile, inc.tiles[j], TILE_SIZE) == 0) {
+          fprintf(stderr, "%s: tile %zu is background tile %zu\n", argv[arg], i, remap[j]);
+          ++found;
+          break;
+        }
+    }
+    fprintf(stderr, "%s: %zu of %zu tiles could be background tiles without adding any\n",
+            argv[arg], found, other.tile_count);
+  }
+
+  if (new_count > limit)
+    fprintf(stderr, "Warning: %s needs %zu tiles, but only %zu fit\n", filename, new_count, limit);
+  if (!duplicates && !unused)
+    return 0;
+
+  // Rewrite the maps, the tile count, and the tiles that are left
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Error: Unable to write \"%s\"\n", filename);
+    return -1;
+  }
+  for (size_t l = 0; l < inc.count; ++l) {
+    const char* line = inc.lines[l];
+    if (is_map_data(&inc, l)) {
+      for (const char* p = line; (p = strchr(p, ',')); ) {
+        char* end;
+        unsigned long t = strtoul(p + 1, &end, 0);
+        fprintf(fp, ",0x%zx", remap[t]);
+        p = end;
+      }
+      fprintf(fp, "};\n");
+    } else if (strncmp(line, "#define ", 8) == 0 && strstr(line, "_SIZE ")) {
+      fprintf(fp, "%.*s %zu\n", (int)(strstr(line, "_SIZE ") + 5 - line), line, new_count);
+    } else if (l >= inc.first_tile && l < inc.first_tile + inc.tile_count) {
+      size_t i = l - inc.first_tile;
+      bool earlier = false;
+      for (size_t j = 0; j < i; ++j)
+        if (remap[j] == remap[i])
+          earlier = true;
+      if (remap[i] == MAX_TILES || earlier)
+        continue; // removed, or a duplicate of an earlier tile
+      fprintf(fp, "%s", (remap[i] == 0) ? "" : ",");
+      for (size_t p = 0; p < TILE_SIZE; ++p)
+        fprintf(fp, " 0x%x%s", inc.tiles[i][p], (p + 1 < TILE_SIZE) ? "," : "");
+      fprintf(fp, "\t\t //tile:%zu\n", remap[i]);
+    } else {
+      fputs(line, fp);
+    }
+  }
+  fclose(fp);
+  return 0;
+}